@@ -17,6 +17,7 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_CPU0   0x68     // Per-CPU data segment for CPU 0, after NCPU TSSs
 
 /*
  * Virtual memory map:                                Permissions
@@ -178,6 +179,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous block on the buddy free list this page heads.
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,7 +188,16 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Set while this page heads a free block of 2^pp_order pages
+	// in the buddy allocator; kmalloc keeps block sizes here too.
+	uint8_t pp_order;
+	uint8_t pp_flags;
 };
 
+// Values of pp_flags
+#define PP_BUDDY	0x01	// Heads a free block on a buddy free list
+#define PP_SLAB		0x02	// Part of a kmalloc slab, pp_order is the slab's order
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -26,15 +26,77 @@ enum {
   SYS_opendir,
   SYS_closedir,
   SYS_mkdir,
+  SYS_get_num_free_block,
+  SYS_get_cpu_stat,
+  SYS_get_kmem_stat,
+  SYS_setpriority,
+  SYS_nice,
+  SYS_nanosleep,
+  SYS_migrate,
+  SYS_sched_setdeadline,
+  SYS_sched_setaffinity,
+  SYS_sched_getaffinity,
+  SYS_get_lock_stat,
+  SYS_set_stack_limit,
   NSYSCALLS
 };
 
+/* per-CPU counters, read with get_cpu_stat */
+enum {
+  CPU_STAT_CR3_LOADS = 0,	/* CR3 loads, each flushes the non-global TLB entries */
+  CPU_STAT_SHOOTDOWNS_SENT,	/* TLB shootdown IPIs sent to other CPUs */
+  CPU_STAT_SHOOTDOWNS_RECV,	/* TLB shootdown requests run for other CPUs */
+  CPU_STAT_TASKS_STOLEN,	/* tasks pulled from other CPUs by the balancer */
+  CPU_STAT_TASKS_MIGRATED,	/* tasks the balancer moved away to other CPUs */
+  CPU_STAT_XCALLS,		/* cross-CPU calls run for other CPUs */
+  CPU_STAT_XCALL_MAX_US,	/* longest a cross-CPU call waited to run, in us */
+  CPU_STAT_DL_MISSES,		/* EDF jobs that ran past their deadline */
+  NCPUSTATS
+};
+
+/* kmalloc size class counters, read with get_kmem_stat */
+enum {
+  KMEM_STAT_SIZE = 0,	/* object size of the class */
+  KMEM_STAT_ALLOCS,	/* kmalloc calls */
+  KMEM_STAT_FREES,	/* kfree calls */
+  KMEM_STAT_SLABS,	/* slabs currently allocated */
+  NKMEMSTATS
+};
+
+/* spinlock counters, read with get_lock_stat; kernel built with LOCKSTAT=1 */
+enum {
+  LOCK_STAT_ACQUIRES = 0,	/* spin_lock calls */
+  LOCK_STAT_CONTENDED,		/* ... that had to wait */
+  LOCK_STAT_SPIN_KCYCLES,	/* TSC cycles spent waiting, in 1024s */
+  NLOCKSTATS
+};
+#define LOCK_NAME_LEN	32	/* room for a name from get_lock_stat */
+
 int32_t get_num_used_page(void);
 
 int32_t cls(void);
 
 int32_t get_num_free_page(void);
 
+int32_t get_num_free_block(int order);
+
+int32_t get_cpu_stat(int cpu, int stat);
+
+int32_t get_kmem_stat(int cls, int stat);
+int32_t get_lock_stat(int lock, int stat, char *name);
+
+int32_t setpriority(int pid, int nice);
+
+int32_t nice(int inc);
+
+int32_t nanosleep(uint32_t sec, uint32_t nsec);
+
+int32_t migrate(int pid, int cpu);
+int32_t sched_setdeadline(uint32_t runtime, uint32_t period, uint32_t deadline);
+int32_t sched_setaffinity(int pid, uint32_t mask);
+int32_t sched_getaffinity(int pid);
+int32_t set_stack_limit(uint32_t bytes);
+
 unsigned long get_ticks(void);
 
 void settextcolor(unsigned char forecolor, unsigned char backcolor);
@@ -296,4 +296,28 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Add inc to *addr; returns what it held before.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (inc), "+m" (*addr) :
+			:
+			"cc");
+	return inc;
+}
+
+// Store newval at addr if it holds oldval; returns what it held.
+static __inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (oldval) :
+			"cc");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
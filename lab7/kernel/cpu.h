@@ -5,11 +5,17 @@
 #include <inc/types.h>
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
+#include <inc/syscall.h>
 #include <kernel/task.h>
+#include <kernel/kmalloc.h>
 
 // Maximum number of CPUs
 #define NCPU  8
 
+// Every CpuInfo starts on a cache line of its own, so CPUs writing
+// their own fields don't keep stealing the line from their neighbours
+#define CACHE_LINE	64
+
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
@@ -17,14 +23,40 @@ enum {
 	CPU_HALTED,
 };
 
+// Changing a mapping other CPUs may have cached in their TLBs takes a
+// shootdown: the CPU making the change posts one request for a whole
+// range of pages and interrupts every CPU that has the address space
+// loaded, then waits for all of them to flush it (see tlb_shootdown).
+struct TlbShootdown {
+	// The request this CPU is waiting on
+	pde_t *volatile tlb_pgdir;
+	volatile uintptr_t tlb_va;
+	volatile uint32_t tlb_npages;
+	volatile uint8_t tlb_global;	// kernel mappings, shared by every pgdir
+	// tlb_pending[i] is set while CPU i waits for us to run its request
+	volatile uint8_t tlb_pending[NCPU];
+};
+
 // Per-CPU state
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // Points here, for thiscpu; must come first
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	Task *cpu_task;          // The currently-running task.
+	Task *cpu_prev;          // Task switched away from (see sched_finish)
+	Task *cpu_dead;          // Killed while running here, stack not freed yet
 	Runqueue cpu_rq;        // cpu runqueue
+	pde_t *cpu_pgdir;               // Address space last loaded by load_pgdir
+	struct TlbShootdown cpu_tlb;    // TLB shootdown requests from and to this CPU
+	struct hrtimer *cpu_hrtimers;   // Pending hrtimers, soonest first
+	struct spinlock cpu_hrtimer_lock; // Protects cpu_hrtimers
+	struct xcall *volatile cpu_xcalls; // Cross-CPU calls for us, newest first
+	uint8_t cpu_next_fork;          // CPU that got our last child (see sys_fork)
+	struct PageCache cpu_pgcache;   // Free pages owned by this CPU
+	struct KmemCpuCache cpu_kmem[KMALLOC_NCLASSES]; // Free kmalloc objects owned by this CPU
+	uint32_t cpu_stat[NCPUSTATS];   // Counters for get_cpu_stat
 	struct tss_struct cpu_tss;        // Used by x86 to find stack for interrupt
-};
+} __attribute__((aligned(CACHE_LINE)));
 
 // Initialized in mpconfig.c
 extern struct CpuInfo cpus[NCPU];
@@ -32,16 +64,33 @@ extern int ncpu;                    // Total number of CPUs in the system
 extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
 extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 
-// Per-CPU kernel stacks
+// Per-CPU kernel stacks, which each CPU boots on; once it runs tasks
+// it is always on the kernel stack of one of them (see sched_start)
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
+// cpunum() reads the local APIC ID, which takes an uncached MMIO read.
+// Once percpu_init has run, %gs of each CPU covers its own CpuInfo,
+// and thiscpu is a single load from there instead.
 int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+void percpu_init(int id);
+
+static __inline struct CpuInfo *
+percpu_self(void)
+{
+	struct CpuInfo *c;
+
+	__asm __volatile("movl %%gs:0, %0" : "=r" (c));
+	return c;
+}
+#define thiscpu (percpu_self())
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_timer(uint32_t count);
+uint32_t lapic_timer_count(void);
 
 #endif
@@ -5,6 +5,9 @@
 #include "disk.h"
 #include <inc/x86.h>
 #include <inc/mmu.h>
+#include <inc/trap.h>
+#include <kernel/picirq.h>
+#include <kernel/wait.h>
 
 #define SECTOR_SIZE 512
 #define FALSE 0
@@ -13,6 +16,16 @@
 unsigned char ide_buf[2048] = {0};
 unsigned static char ide_irq_invoked = 0;
 
+// Once disk_irq_init has run, a task waits for the primary channel
+// asleep on ide_wait until IRQ 14 comes, instead of spinning on the
+// status register, and the CPU runs other tasks meanwhile.  The file
+// system calls take turns on the disk (see fs_mutex), so one
+// ide_irq_invoked will do.  The secondary channel, and the tests at
+// boot, still poll.
+static struct waitqueue ide_wait;	// its lock protects ide_irq_invoked
+unsigned static char ide_use_irq = FALSE;
+static void ide_wait_irq(unsigned char channel);
+
 unsigned static char ide_status = 0;
 
 void ide_initialize(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, unsigned int BAR3, unsigned int BAR4);
@@ -35,6 +48,44 @@ int disk_init()
 	return 0;
 }
 
+static void ide_intr(struct Trapframe *tf)
+{
+	// reading the status lets the drive drop its interrupt
+	ide_read(ATA_PRIMARY, ATA_REG_STATUS);
+	// unlike the master, the slave 8259A takes an explicit EOI
+	outb(IO_PIC2, 0x20);
+
+	spin_lock(&ide_wait.wq_lock);
+	ide_irq_invoked = 1;
+	spin_unlock(&ide_wait.wq_lock);
+	wq_wake(&ide_wait, 1);
+}
+
+// Called once only tasks use the disk: they can sleep for it
+void disk_irq_init()
+{
+	extern void IDE_ISR();
+
+	wq_init(&ide_wait);
+	register_handler(IRQ_OFFSET + IRQ_IDE, &ide_intr, &IDE_ISR, 0, 0);
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_IDE));
+	ide_use_irq = TRUE;
+}
+
+// Sleep until the interrupt of the access in progress, if it has
+// interrupts on (see ide_ata_access).  The status is still checked
+// by ide_polling afterwards.
+static void ide_wait_irq(unsigned char channel)
+{
+	if (channels[channel].nIEN)
+		return;
+	spin_lock(&ide_wait.wq_lock);
+	while (!ide_irq_invoked)
+		wq_sleep(&ide_wait);
+	ide_irq_invoked = 0;
+	spin_unlock(&ide_wait.wq_lock);
+}
+
 void disk_test()
 {
 	unsigned char buf[SECTOR_SIZE];
@@ -262,9 +313,12 @@ unsigned char ide_ata_access(unsigned char direction, unsigned char drive, unsig
 	unsigned int  bus = channels[channel].base; // Bus Base, like 0x1F0 which is also data port.
 	unsigned int  words      = 256; // Almost every ATA drive has a sector-size of 512-byte.
 	unsigned short cyl, i;
+	unsigned int  count; // rep insw/outsw count this down, and move edi on
 	unsigned char head, sect, err;
 
-	ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = (ide_irq_invoked = 0x0) + 0x02);
+	// interrupts only on the primary channel, once tasks can sleep
+	ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN =
+	    (ide_irq_invoked = 0x0) + (ide_use_irq && channel == ATA_PRIMARY ? 0x00 : 0x02));
 
 	// (I) Select one from LBA28, LBA48 or CHS;
 	if (lba >= 0x10000000) { // Sure Drive should support LBA in this case, or you are
@@ -351,22 +405,31 @@ unsigned char ide_ata_access(unsigned char direction, unsigned char drive, unsig
 		if (direction == 0)
 		{
 			// PIO Read.
+			// the drive interrupts once each sector is ready
 			for (i = 0; i < numsects; i++) {
+				ide_wait_irq(channel);
 				if (err = ide_polling(channel, 1))
 					return err; // Polling, set error and exit if there is.
-				asm("rep insw" : : "c"(words), "d"(bus), "D"(edi)); // Receive Data.
+				count = words;
+				asm volatile("rep insw" : "+c"(count), "+D"(edi) : "d"(bus) : "memory"); // Receive Data.
 			} 
 		}
 		else 
 		{
-			// PIO Write.
+			// PIO Write.  The drive interrupts once it took each
+			// sector, and once the flush is done.
 			for (i = 0; i < numsects; i++) {
+				if (i > 0)
+					ide_wait_irq(channel);
 				ide_polling(channel, 0); // Polling.
-				asm("rep outsw"::"c"(words), "d"(bus), "S"(edi)); // Send Data
+				count = words;
+				asm volatile("rep outsw" : "+c"(count), "+S"(edi) : "d"(bus)); // Send Data
 			}
+			ide_wait_irq(channel);
 			ide_write(channel, ATA_REG_COMMAND, (char []) {   ATA_CMD_CACHE_FLUSH,
 					ATA_CMD_CACHE_FLUSH,
 					ATA_CMD_CACHE_FLUSH_EXT}[lba_mode]);
+			ide_wait_irq(channel);
 			ide_polling(channel, 0); // Polling.
 		}
 
@@ -4,9 +4,10 @@
 #include <fat/ff.h>
 #include <inc/string.h>
 #include <inc/stdio.h>
+#include <kernel/kmalloc.h>
 
-/* Static file objects */
-FIL file_objs[FS_FD_MAX];
+/* File objects (FIL) are kmalloc'ed when a file is opened and freed
+ * with its last descriptor reference, see file_open and fd_put */
 
 /* Static file system object */
 FATFS fat;
@@ -152,7 +153,7 @@ int fs_init()
         fd_table[i].pos = 0;
         fd_table[i].type = 0;
         fd_table[i].ref_count = 0;
-        fd_table[i].data = &file_objs[i];
+        fd_table[i].data = NULL;
         fd_table[i].fs = &fat_fs;
     }
     
@@ -189,12 +190,20 @@ int file_open(struct fs_fd* fd, const char *path, int flags)
 {
 	fd->flags = flags;
     strcpy(fd->path, path);
+    if (!fd->data)
+    {
+        if (!(fd->data = kmalloc(sizeof(FIL))))
+            return -STATUS_ENOMEM;
+        memset(fd->data, 0, sizeof(FIL));
+    }
     int ret = fat_fs.ops->open(fd);
     return error_handle(-ret);
 }
 
 int file_read(struct fs_fd* fd, void *buf, size_t len)
 {
+    if (!fd->data)
+        return -STATUS_EBADF;
     int ret = fat_fs.ops->read(fd, buf, len);
     // printk("%d\n", ret);
     if(ret<0)
@@ -204,6 +213,8 @@ int file_read(struct fs_fd* fd, void *buf, size_t len)
 
 int file_write(struct fs_fd* fd, const void *buf, size_t len)
 {
+    if (!fd->data)
+        return -STATUS_EBADF;
     int ret = fat_fs.ops->write(fd, buf, len);
     // printk("%d\n", ret);
     if(ret<0)
@@ -213,11 +224,15 @@ int file_write(struct fs_fd* fd, const void *buf, size_t len)
 
 int file_close(struct fs_fd* fd)
 {
+    if (!fd->data)
+        return -STATUS_EBADF;
     int ret = fat_fs.ops->close(fd);
     return error_handle(-ret);
 }
 int file_lseek(struct fs_fd* fd, off_t offset)
 {
+    if (!fd->data)
+        return -STATUS_EBADF;
     int ret = fat_fs.ops->lseek(fd,offset);
     return error_handle(-ret);
 }
@@ -231,6 +246,8 @@ int file_unlink(const char *path)
             if(!strcmp(fd_table[i].path, path)){
                 memset(fd_table[i].path, 0, sizeof(fd_table[i].path));
                 fd_table[i].ref_count = 0;
+                kfree(fd_table[i].data);
+                fd_table[i].data = NULL;
                 break;
             }
         }
@@ -328,7 +345,8 @@ void fd_put(struct fs_fd* fd)
 	if ( fd->ref_count == 0 )
 	{
 		//memset(fd, 0, sizeof(struct fs_fd));
-		memset(fd->data, 0, sizeof(FIL));
+		kfree(fd->data);
+		fd->data = NULL;
 	}
 };
 
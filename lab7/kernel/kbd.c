@@ -6,6 +6,7 @@
 #include <kernel/trap.h>
 #include <kernel/picirq.h>
 #include <inc/stdio.h>
+#include <kernel/wait.h>
 
 /***** Keyboard input code *****/
 
@@ -167,6 +168,9 @@ static struct {
   uint32_t wpos;
 } cons;
 
+// Tasks waiting for input; its lock also protects cons
+static struct waitqueue cons_wait;
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
   static void
@@ -212,11 +216,15 @@ cons_getc(void)
 void
 kbd_intr(struct Trapframe *tf)
 {
+  spin_lock(&cons_wait.wq_lock);
   cons_intr(kbd_proc_data);
+  spin_unlock(&cons_wait.wq_lock);
+  wq_wake(&cons_wait, 1);
 }
 
 void kbd_init(void)
 {
+  wq_init(&cons_wait);
   // Drain the kbd buffer so that Bochs generates interrupts.
   kbd_intr(NULL);
   irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_KBD));
@@ -226,10 +234,15 @@ void kbd_init(void)
 }
 
 /* high-level console I/O */
+/* Blocks: with no input yet, the calling task sleeps until the keyboard
+ * interrupt brings some */
 int k_getc(void)
 {
-  // In lab4, our task is switched to user mode, so dont block at there
-  //while ((c = cons_getc()) == 0)
-  /* do nothing *///;
-  return cons_getc();
+  int c;
+
+  spin_lock(&cons_wait.wq_lock);
+  while ((c = cons_getc()) == 0)
+    wq_sleep(&cons_wait);
+  spin_unlock(&cons_wait.wq_lock);
+  return c;
 }
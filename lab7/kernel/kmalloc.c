@@ -0,0 +1,326 @@
+/* General-purpose allocator for kernel objects */
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <kernel/kmalloc.h>
+#include <kernel/mem.h>
+#include <kernel/cpu.h>
+#include <kernel/spinlock.h>
+
+// --------------------------------------------------------------
+// A slab is a block of pages from alloc_pages carved into objects of
+// one size class.  It starts with a struct Slab, and the objects
+// follow from the first multiple of the object size, so every
+// object is aligned to its own size.  Every page of a slab is marked
+// PP_SLAB with the slab's order in pp_order, which is how kfree gets
+// from an object back to its slab.
+// --------------------------------------------------------------
+
+struct Slab {
+	struct Slab *sl_next;	// on km_partial
+	struct Slab *sl_prev;
+	void *sl_free;		// free objects, linked through their first word
+	uint16_t sl_inuse;	// objects handed out
+	uint16_t sl_class;
+};
+
+struct KmemCache {
+	struct spinlock km_lock;	// Protects everything below
+	struct Slab *km_partial;	// slabs with at least one free object
+	uint32_t km_slabs;		// slabs allocated
+};
+
+static struct KmemCache kmem_caches[KMALLOC_NCLASSES];
+
+#define KMEM_SIZE(cls)	(1 << ((cls) + KMALLOC_MIN_SHIFT))
+// 1KB and 2KB objects get 16KB slabs, so the header wastes one object
+// in eight instead of half the slab
+#define KMEM_ORDER(cls)	(KMEM_SIZE(cls) >= 1024 ? 2 : 0)
+#define KMEM_OBJS(cls)	((PGSIZE << KMEM_ORDER(cls)) / KMEM_SIZE(cls) - \
+			 ROUNDUP(sizeof(struct Slab), KMEM_SIZE(cls)) / KMEM_SIZE(cls))
+
+static void check_kmalloc(void);
+
+void
+kmalloc_init(void)
+{
+	int cls;
+
+	for (cls = 0; cls < KMALLOC_NCLASSES; cls++)
+	{
+		spin_initlock(&kmem_caches[cls].km_lock);
+		kmem_caches[cls].km_partial = NULL;
+		kmem_caches[cls].km_slabs = 0;
+	}
+	check_kmalloc();
+}
+
+static void
+slab_list_add(struct KmemCache *km, struct Slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = km->km_partial;
+	if (km->km_partial)
+		km->km_partial->sl_prev = sl;
+	km->km_partial = sl;
+}
+
+static void
+slab_list_del(struct KmemCache *km, struct Slab *sl)
+{
+	if (sl->sl_prev)
+		sl->sl_prev->sl_next = sl->sl_next;
+	else
+		km->km_partial = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_prev = sl->sl_prev;
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+//
+// Allocate a new slab for size class 'cls' and put it on km_partial.
+// Caller holds km_lock.
+//
+static struct Slab *
+slab_grow(int cls)
+{
+	struct KmemCache *km = &kmem_caches[cls];
+	int order = KMEM_ORDER(cls), size = KMEM_SIZE(cls);
+	struct PageInfo *pp;
+	struct Slab *sl;
+	char *obj;
+	int i;
+
+	if (!(pp = alloc_pages(0, order)))
+		return NULL;
+	for (i = 0; i < (1 << order); i++)
+	{
+		pp[i].pp_flags |= PP_SLAB;
+		pp[i].pp_order = order;
+	}
+
+	sl = page2kva(pp);
+	sl->sl_inuse = 0;
+	sl->sl_class = cls;
+	sl->sl_free = NULL;
+	obj = (char *) sl + (PGSIZE << order) - size;
+	for (i = 0; i < KMEM_OBJS(cls); i++, obj -= size)
+	{
+		*(void **) obj = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	slab_list_add(km, sl);
+	km->km_slabs++;
+	return sl;
+}
+
+//
+// Give the pages of an empty slab back.  Caller holds km_lock.
+//
+static void
+slab_destroy(struct Slab *sl)
+{
+	struct KmemCache *km = &kmem_caches[sl->sl_class];
+	int order = KMEM_ORDER(sl->sl_class);
+	struct PageInfo *pp = pa2page(PADDR(sl));
+	int i;
+
+	slab_list_del(km, sl);
+	km->km_slabs--;
+	for (i = 0; i < (1 << order); i++)
+		pp[i].pp_flags &= ~PP_SLAB;
+	free_pages(pp, order);
+}
+
+//
+// Move up to KMEM_BATCH objects of class 'cls' from the slabs into
+// 'kc'.  Returns the number of objects moved.
+//
+static int
+kmem_refill(int cls, struct KmemCpuCache *kc)
+{
+	struct KmemCache *km = &kmem_caches[cls];
+	struct Slab *sl;
+	int n;
+
+	spin_lock(&km->km_lock);
+	for (n = 0; n < KMEM_BATCH; n++)
+	{
+		if (!(sl = km->km_partial) && !(sl = slab_grow(cls)))
+			break;
+		kc->kc_objs[kc->kc_count++] = sl->sl_free;
+		sl->sl_free = *(void **) sl->sl_free;
+		sl->sl_inuse++;
+		if (!sl->sl_free)
+			slab_list_del(km, sl);
+	}
+	spin_unlock(&km->km_lock);
+	return n;
+}
+
+//
+// Give objects of 'kc' back to their slabs until at most 'keep' are
+// left.  A slab that becomes empty is freed, unless it is the only
+// one left with free objects.
+//
+static void
+kmem_drain(int cls, struct KmemCpuCache *kc, int keep)
+{
+	struct KmemCache *km = &kmem_caches[cls];
+	struct Slab *sl;
+	void *obj;
+
+	spin_lock(&km->km_lock);
+	while (kc->kc_count > keep)
+	{
+		obj = kc->kc_objs[--kc->kc_count];
+		sl = ROUNDDOWN(obj, PGSIZE << KMEM_ORDER(cls));
+		if (!sl->sl_free)
+			slab_list_add(km, sl);
+		*(void **) obj = sl->sl_free;
+		sl->sl_free = obj;
+		if (--sl->sl_inuse == 0 && (sl->sl_next || sl->sl_prev))
+			slab_destroy(sl);
+	}
+	spin_unlock(&km->km_lock);
+}
+
+//
+// Allocate 'size' bytes of kernel memory.  Blocks of up to 2KB are
+// aligned to their size class, bigger ones to a page.
+//
+// Returns NULL if size is 0 or memory is exhausted.
+//
+void *
+kmalloc(size_t size)
+{
+	struct KmemCpuCache *kc;
+	struct PageInfo *pp;
+	int cls, order;
+
+	if (size == 0)
+		return NULL;
+
+	if (size > KMEM_SIZE(KMALLOC_NCLASSES - 1))
+	{
+		for (order = 0; (PGSIZE << order) < size; order++)
+			;
+		if (!(pp = alloc_pages(0, order)))
+			return NULL;
+		pp->pp_order = order;
+		return page2kva(pp);
+	}
+
+	for (cls = 0; KMEM_SIZE(cls) < size; cls++)
+		;
+	kc = &thiscpu->cpu_kmem[cls];
+	if (kc->kc_count == 0 && kmem_refill(cls, kc) == 0)
+		return NULL;
+	kc->kc_allocs++;
+	return kc->kc_objs[--kc->kc_count];
+}
+
+//
+// Free a block returned by kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *ptr)
+{
+	struct KmemCpuCache *kc;
+	struct PageInfo *pp;
+	int cls;
+
+	if (ptr == NULL)
+		return;
+
+	pp = pa2page(PADDR(ptr));
+	if (!(pp->pp_flags & PP_SLAB))
+	{
+		free_pages(pp, pp->pp_order);
+		return;
+	}
+
+	cls = ((struct Slab *) ROUNDDOWN(ptr, PGSIZE << pp->pp_order))->sl_class;
+	kc = &thiscpu->cpu_kmem[cls];
+	if (kc->kc_count == KMEM_HIGH)
+		kmem_drain(cls, kc, KMEM_HIGH - KMEM_BATCH);
+	kc->kc_objs[kc->kc_count++] = ptr;
+	kc->kc_frees++;
+}
+
+/* This is the system call implementation of get_kmem_stat */
+/* One counter of size class 'cls', or -1 past the last class */
+int32_t
+sys_get_kmem_stat(int cls, int stat)
+{
+  int32_t val = 0;
+  int i;
+
+  if (cls < 0 || cls >= KMALLOC_NCLASSES)
+    return -1;
+  for (i = 0; i < ncpu; i++)
+  {
+    if (stat == KMEM_STAT_ALLOCS)
+      val += cpus[i].cpu_kmem[cls].kc_allocs;
+    else if (stat == KMEM_STAT_FREES)
+      val += cpus[i].cpu_kmem[cls].kc_frees;
+  }
+  if (stat == KMEM_STAT_SIZE)
+    val = KMEM_SIZE(cls);
+  else if (stat == KMEM_STAT_SLABS)
+    val = kmem_caches[cls].km_slabs;
+  else if (stat < 0 || stat >= NKMEMSTATS)
+    return -1;
+  return val;
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static void
+check_kmalloc(void)
+{
+	char *p[KMEM_HIGH + KMEM_BATCH];
+	char *big;
+	int cls, i, j, size;
+	uint32_t slabs;
+
+	for (cls = 0; cls < KMALLOC_NCLASSES; cls++)
+	{
+		size = KMEM_SIZE(cls);
+		slabs = kmem_caches[cls].km_slabs;
+
+		// more than a CPU caches, so the drain path runs too
+		for (i = 0; i < KMEM_HIGH + KMEM_BATCH; i++)
+		{
+			assert((p[i] = kmalloc(size - size / 4)));
+			assert((uintptr_t) p[i] % size == 0);
+			assert(pa2page(PADDR(p[i]))->pp_flags & PP_SLAB);
+			memset(p[i], i, size);
+		}
+		for (i = 0; i < KMEM_HIGH + KMEM_BATCH; i++)
+			for (j = 0; j < size; j += size / 4)
+				assert(p[i][j] == (char) i);
+		for (i = 0; i < KMEM_HIGH + KMEM_BATCH; i++)
+			kfree(p[i]);
+
+		// once this CPU lets go of its cached objects, at most one
+		// empty slab is kept around
+		kmem_drain(cls, &thiscpu->cpu_kmem[cls], 0);
+		assert(kmem_caches[cls].km_slabs <= slabs + 1);
+	}
+
+	// bigger blocks come straight from the buddy allocator
+	assert((big = kmalloc(3 * PGSIZE)));
+	assert((uintptr_t) big % PGSIZE == 0);
+	assert(!(pa2page(PADDR(big))->pp_flags & PP_SLAB));
+	memset(big, 0x97, 3 * PGSIZE);
+	kfree(big);
+
+	assert(!kmalloc(0));
+	kfree(NULL);
+
+	printk("check_kmalloc() succeeded!\n");
+}
@@ -0,0 +1,31 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+
+#include <inc/types.h>
+
+// kmalloc serves requests from 16 bytes up to 2KB out of slabs, one
+// object cache per power-of-two size class.  Anything bigger gets a
+// block of whole pages from alloc_pages.
+#define KMALLOC_MIN_SHIFT	4
+#define KMALLOC_MAX_SHIFT	11
+#define KMALLOC_NCLASSES	(KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// Like the page caches, each CPU keeps some free objects of every size
+// class, so kmalloc/kfree only take a cache's lock every KMEM_BATCH
+// objects.
+#define KMEM_BATCH	8	// objects moved between a CPU and the slabs at once
+#define KMEM_HIGH	32	// most free objects a CPU keeps per size class
+
+struct KmemCpuCache {
+	void *kc_objs[KMEM_HIGH];	// LIFO stack of free objects
+	int32_t kc_count;		// number of objects on kc_objs
+	uint32_t kc_allocs;		// kmalloc calls served on this CPU
+	uint32_t kc_frees;		// kfree calls made on this CPU
+};
+
+void	kmalloc_init(void);
+void	*kmalloc(size_t size);
+void	kfree(void *ptr);
+int32_t	sys_get_kmem_stat(int cls, int stat);
+
+#endif
@@ -66,12 +66,13 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from
+	// lapic[TICR] and then issues an interrupt; timer_reprogram
+	// sets it again for each next event, using the rate measured
+	// against the PIT by timer_init.  Until then the first
+	// interrupt comes after an arbitrary count.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
 	lapicw(TICR, 10000000); 
 
 	// Leave LINT0 of the BSP enabled so that it can get
@@ -181,3 +182,27 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Start the one-shot timer, to interrupt after 'count' bus cycles.
+void
+lapic_timer(uint32_t count)
+{
+	lapicw(TICR, count);
+}
+
+// What is left of the timer's count.
+uint32_t
+lapic_timer_count(void)
+{
+	return lapic[TCCR];
+}
+
+// Send an interrupt to the CPU whose local APIC ID is apicid only.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
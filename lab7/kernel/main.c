@@ -3,6 +3,7 @@
 #include <inc/shell.h>
 #include <inc/x86.h>
 #include <kernel/mem.h>
+#include <kernel/kmalloc.h>
 #include <kernel/trap.h>
 #include <kernel/picirq.h>
 #include <kernel/task.h>
@@ -17,6 +18,7 @@ extern void init_video(void);
 static void boot_aps(void);
 extern int disk_init();
 extern void disk_test();
+extern void disk_irq_init();
 
 void kernel_main(void)
 {
@@ -24,8 +26,11 @@ void kernel_main(void)
 	extern char etext[], end[], data_start[],rdata_end[];
 	extern void task_job();
 
+	// the boot CPU is CPU 0 until mp_init finds out more
+	percpu_init(0);
 	init_video();
   	mem_init();
+	kmalloc_init();
 	mp_init();
 	lapic_init();
   	task_init();
@@ -46,22 +51,11 @@ void kernel_main(void)
   printk("Readonly data start=0x%08x to = 0x%08x\n", etext, rdata_end);
   printk("Kernel data base start=0x%08x to = 0x%08x\n", data_start, end);
 
+  /* From now on the disk is only used by tasks, which can sleep for it */
+  disk_irq_init();
 
-  /* Enable interrupt */
-  __asm __volatile("sti");
-
-  lcr3(PADDR(thiscpu->cpu_task->pgdir));
-
-  /* Move to user mode */
-  asm volatile("movl %0,%%eax\n\t" \
-  "pushl %1\n\t" \
-  "pushl %%eax\n\t" \
-  "pushfl\n\t" \
-  "pushl %2\n\t" \
-  "pushl %3\n\t" \
-  "iret\n" \
-  :: "m" (thiscpu->cpu_task->tf.tf_esp), "i" (GD_UD | 0x03), "i" (GD_UT | 0x03), "m" (thiscpu->cpu_task->tf.tf_eip)
-  :"ax");
+  /* Move to user mode: the shell enables interrupts on its way there */
+  sched_start();
 }
 
 // While boot_aps is booting a given CPU, it communicates the per-core
@@ -92,7 +86,7 @@ boot_aps(void)
 	int i;
 	for(i = 0 ; i < ncpu ; i++){
 		// skip current cpu
-		if(cpus[i].cpu_id == cpunum())
+		if(&cpus[i] == thiscpu)
 			continue;
 		// set the correct kernel stack address
 		mpentry_kstack = percpu_kstacks[i] + KSTKSIZE;
@@ -170,8 +164,10 @@ mp_main(void)
 	 */
 	
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	lcr4(rcr4() | kern_cr4);
 	lcr3(PADDR(kern_pgdir));
-	printk("SMP: CPU %d starting\n", cpunum());
+	percpu_init(cpunum());
+	printk("SMP: CPU %d starting\n", thiscpu->cpu_id);
 	
 	// Your code here:
 	lapic_init();
@@ -185,22 +181,8 @@ mp_main(void)
 	// Your code here:
     xchg(&thiscpu->cpu_status, CPU_STARTED);
 
-
-
-	/* Enable interrupt */
-	__asm __volatile("sti");
-
-	lcr3(PADDR(thiscpu->cpu_task->pgdir));
-
-	/* Move to user mode */
-	asm volatile("movl %0,%%eax\n\t" \
-			"pushl %1\n\t" \
-			"pushl %%eax\n\t" \
-			"pushfl\n\t" \
-			"pushl %2\n\t" \
-			"pushl %3\n\t" \
-			"iret\n" \
-			:: "m" (thiscpu->cpu_task->tf.tf_esp), "i" (GD_UD | 0x03), "i" (GD_UT | 0x03), "m" (thiscpu->cpu_task->tf.tf_eip)
-			:"ax");
+	/* Nothing to run here yet: wait in the idle loop, which enables
+	 * interrupts while it halts */
+	sched_start();
 
 }
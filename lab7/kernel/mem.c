@@ -5,6 +5,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/trap.h>
 
 #include <kernel/mem.h>
 #include <kernel/kclock.h>
@@ -18,10 +19,27 @@ static char              *nextfree;	// virtual address of next byte of free memo
 
 // These variables are set in mem_init()
 pde_t                    *kern_pgdir;		// Kernel's initial page directory
+uint32_t                 kern_cr4;		// CR4 bits kern_pgdir relies on
 struct PageInfo          *pages;		// Physical page state array
-static struct PageInfo   *page_free_list;	// Free list of physical pages
-size_t                   num_free_pages;
-struct spinlock page_lock;
+static struct PageInfo   *free_area[MAX_ORDER];	// Buddy free lists, one per order
+static size_t            free_blocks[MAX_ORDER];	// Blocks on each free_area list
+size_t                   num_free_pages;	// Pages held by the buddy allocator
+struct spinlock page_lock;			// Protects free_area
+static struct PageInfo   *zero_pages;		// Free pages cleared by page_prezero
+static size_t            num_zero_pages;	// Pages on zero_pages
+static struct spinlock   zero_lock;		// Protects zero_pages
+
+#define CPUID_FLAG_PSE	0x00000008	// CPUID.1:EDX, 4MB pages supported
+#define CPUID_FLAG_PGE	0x00002000	// CPUID.1:EDX, global pages supported
+
+// Page directory entries that every address space shares with
+// kern_pgdir: everything above UTOP, and the IO hole at its physical
+// address, where the console writes.
+#define PDE_SHARED(i)	((i) >= PDX(UTOP) || (i) == PDX(IOPHYSMEM))
+
+// A shootdown of more pages than this flushes the whole TLB instead
+// of invalidating the pages one by one
+#define TLB_INVLPG_MAX	32
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -62,13 +80,18 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
+static void check_page_prezero(void);
 static void check_page_alloc(void);
+static void check_page_cache(void);
+static void check_buddy(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void check_page_cow(void);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -81,7 +104,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the buddy free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -124,17 +147,17 @@ void
 mem_init(void)
 {
 	spin_initlock(&page_lock);
+	spin_initlock(&zero_lock);
 	uint32_t cr0;
     nextfree = 0;
-    page_free_list = 0;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
-	kern_pgdir = (pde_t *) boot_alloc(PGSIZE);
-	memset(kern_pgdir, 0, PGSIZE);		//init the PGSIZE bytes from kern_pgdir to zero
+	kern_pgdir = (pde_t *) boot_alloc(PGSIZE << PGDIR_ORDER);
+	memset(kern_pgdir, 0, PGSIZE << PGDIR_ORDER);		//init the page directory and its PgdirInfo to zero
 
 	//////////////////////////////////////////////////////////////////////
 	// Recursively insert PD in itself as a page table, to form
@@ -165,6 +188,9 @@ mem_init(void)
 
 	check_page_free_list(1);
 	check_page_alloc();
+	check_page_cache();
+	check_page_prezero();
+	check_buddy();
 	check_page();
 
 	//////////////////////////////////////////////////////////////////////
@@ -178,7 +204,7 @@ mem_init(void)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
     boot_map_region(kern_pgdir, UPAGES, ROUNDUP((sizeof(struct PageInfo) * npages), \
-    				PGSIZE), PADDR(pages), (PTE_U | PTE_P));
+    				PGSIZE), PADDR(pages), (PTE_U | PTE_P | PTE_G));
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -203,14 +229,35 @@ mem_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
 
-    boot_map_region(kern_pgdir, KERNBASE, ROUNDUP(2^32 - KERNBASE, PGSIZE), 0, (PTE_W | PTE_P));
-	
+	// The kernel image, with the user programs linked into it, gets 4KB
+	// pages so that setupvm can open up just the user parts; the rest
+	// uses 4MB pages if the CPU has PSE.
+	// Everything the kernel maps here and below looks the same in every
+	// address space, so it is marked PTE_G: with CR4_PGE those TLB
+	// entries survive the CR3 load of a context switch.
+	extern char end[];
+	uint32_t image_sz = ROUNDUP(PADDR(end), PTSIZE);
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_FLAG_PSE)
+		kern_cr4 |= CR4_PSE;
+	if (edx & CPUID_FLAG_PGE)
+		kern_cr4 |= CR4_PGE;
+	boot_map_region(kern_pgdir, KERNBASE, image_sz, 0, (PTE_W | PTE_P | PTE_G));
+	boot_map_region_large(kern_pgdir, KERNBASE + image_sz, -(KERNBASE + image_sz), image_sz, (PTE_W | PTE_P | PTE_G));
+
 	//////////////////////////////////////////////////////////////////////
 	// Map VA range [IOPHYSMEM, EXTPHYSMEM) to PA range [IOPHYSMEM, EXTPHYSMEM)
-    boot_map_region(kern_pgdir, IOPHYSMEM, ROUNDUP((EXTPHYSMEM - IOPHYSMEM), PGSIZE), IOPHYSMEM, (PTE_W) | (PTE_P));
+    boot_map_region(kern_pgdir, IOPHYSMEM, ROUNDUP((EXTPHYSMEM - IOPHYSMEM), PGSIZE), IOPHYSMEM, (PTE_W) | (PTE_P) | (PTE_G));
 
   	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
+
+	// Every address space shares the kernel's page tables (see setupkvm),
+	// so the ones that are filled in later must exist already.
+	if (!pgdir_walk(kern_pgdir, (void *) MMIOBASE, 1))
+		panic("mem_init: out of memory for the MMIO page table");
 	// Check that the initial page directory has been set up correctly.
 	check_kern_pgdir();
 
@@ -222,6 +269,7 @@ mem_init(void)
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
 	// cprintf("%u\n",PADDR(kern_pgdir));
+	lcr4(rcr4() | kern_cr4);
 	lcr3(PADDR(kern_pgdir));
 
 	check_page_free_list(0);
@@ -236,6 +284,7 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+	check_page_cow();
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -263,7 +312,7 @@ mem_init_mp(void)
     int temp = KSTACKTOP;
     int i=0;
     for(i; i < NCPU ; i++){
-        boot_map_region(kern_pgdir, temp - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_P);
+        boot_map_region(kern_pgdir, temp - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_P | PTE_G);
         temp = temp-(KSTKSIZE+KSTKGAP);
     }
 
@@ -272,14 +321,96 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy
+// allocator: free_area[k] lists the free blocks of 2^k pages, each
+// block aligned to its own size.  A block's buddy is the block it was
+// split from, and the two are merged again as soon as both are free.
 // --------------------------------------------------------------
 
+static void
+buddy_list_add(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_BUDDY;
+	pp->pp_prev = NULL;
+	pp->pp_link = free_area[order];
+	if (free_area[order])
+		free_area[order]->pp_prev = pp;
+	free_area[order] = pp;
+	free_blocks[order]++;
+	num_free_pages += 1 << order;
+}
+
+static void
+buddy_list_del(struct PageInfo *pp, int order)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		free_area[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_flags &= ~PP_BUDDY;
+	free_blocks[order]--;
+	num_free_pages -= 1 << order;
+}
+
+//
+// Take a free block of 2^order pages, splitting a larger one if
+// needed.  The upper halves of a split go back on the free lists.
+// Caller holds page_lock.
+//
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o < MAX_ORDER && !free_area[o]; o++)
+		;
+	if (o == MAX_ORDER)
+		return NULL;
+
+	pp = free_area[o];
+	buddy_list_del(pp, o);
+	while (o > order)
+	{
+		o--;
+		buddy_list_add(pp + (1 << o), o);
+	}
+	return pp;
+}
+
+//
+// Return a block of 2^order pages, merging it with its buddy for as
+// long as the buddy is free and whole.  Caller holds page_lock.
+//
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t pfn = pp - pages;
+	size_t buddy;
+
+	while (order < MAX_ORDER - 1)
+	{
+		buddy = pfn ^ (1 << order);
+		if (buddy + (1 << order) > npages)
+			break;
+		if (!(pages[buddy].pp_flags & PP_BUDDY) || pages[buddy].pp_order != order)
+			break;
+		buddy_list_del(&pages[buddy], order);
+		pfn &= buddy;
+		order++;
+	}
+	buddy_list_add(&pages[pfn], order);
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy free lists.
 //
 void
 page_init(void)
@@ -302,86 +433,175 @@ page_init(void)
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
 	
-    /* TODO */
-	num_free_pages =0;
-	// 1) Mark physical page 0 as in use.
-	pages[0].pp_link = 0;
-	pages[0].pp_ref = 1;
-
-	// 2) The rest of base memory, [PGSIZE, npages_basemem * PGSIZE) is free.
 	size_t i;
-	for(i = 1;i<npages_basemem;i++)
+	size_t first_free = PGNUM(PADDR(boot_alloc(0)));
+
+	// Everything is in use until shown to be free; this also covers
+	// 1) physical page 0 and 3) the IO hole.
+	for (i = 0; i < npages; i++)
 	{
-		if(i<=PGNUM(MPENTRY_PADDR))
-		{
-			pages[i].pp_link = 0;
-			pages[i].pp_ref = 1;
-			continue;
-		}
+		pages[i].pp_link = 0;
+		pages[i].pp_ref = 1;
+	}
+
+	// 2) The rest of base memory, [PGSIZE, npages_basemem * PGSIZE) is free,
+	// except the pages up to MPENTRY_PADDR, where the AP bootstrap code
+	// is copied.
+	for (i = PGNUM(MPENTRY_PADDR) + 1; i < npages_basemem; i++)
 		pages[i].pp_ref = 0;
-        pages[i].pp_link = page_free_list;
-        page_free_list = &pages[i];
-        num_free_pages++;
+
+	// 4) Extended memory is free above the kernel and what boot_alloc
+	// handed out.
+	for (i = first_free; i < npages; i++)
+		pages[i].pp_ref = 0;
+
+	// Hand the free pages to the buddy allocator from the top down, so
+	// the lowest blocks end up at the head of each free list.  Until
+	// kern_pgdir is loaded only the low 4MB are mapped, and early page
+	// tables must come from there.
+	num_free_pages = 0;
+	for (i = npages; i-- > 0; )
+		if (pages[i].pp_ref == 0)
+			buddy_free(&pages[i], 0);
+}
+
+//
+// Move up to PCP_BATCH order-0 pages from the buddy allocator into
+// 'pc'.  Returns the number of pages moved.
+//
+static int
+page_cache_refill(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+	int n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < PCP_BATCH && (pp = buddy_alloc(0)); n++)
+	{
+		pp->pp_link = pc->pc_free;
+		pc->pc_free = pp;
 	}
+	spin_unlock(&page_lock);
+	pc->pc_count += n;
+	return n;
+}
+
+//
+// Give pages of 'pc' back to the buddy allocator until at most
+// 'keep' pages are left in the cache.
+//
+static void
+page_cache_drain(struct PageCache *pc, int keep)
+{
+	struct PageInfo *pp;
 
-	// 3) Then comes the IO hole [IOPHYSMEM, EXTPHYSMEM), which must never be allocated.
-	i = PGNUM(IOPHYSMEM);
-	for(i;i<PGNUM(EXTPHYSMEM);i++)
+	spin_lock(&page_lock);
+	while (pc->pc_count > keep)
 	{
-		pages[i].pp_link = 0;
-		pages[i].pp_ref = 1;
+		pp = pc->pc_free;
+		pc->pc_free = pp->pp_link;
+		pc->pc_count--;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Take a page off this CPU's cache, refilling it first if it is empty.
+//
+static struct PageInfo *
+page_cache_pop(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+
+	if (!pc->pc_free && !page_cache_refill(pc))
+		return NULL;
+	pp = pc->pc_free;
+	pc->pc_free = pp->pp_link;
+	pc->pc_count--;
+	pp->pp_link = NULL;
+	return pp;
+}
+
+//
+// Take a page off the pool of pre-zeroed pages, if there is one.
+//
+static struct PageInfo *
+zero_pages_pop(void)
+{
+	struct PageInfo *pp;
+
+	if (!zero_pages)
+		return NULL;
+	spin_lock(&zero_lock);
+	if ((pp = zero_pages))
+	{
+		zero_pages = pp->pp_link;
+		num_zero_pages--;
+		pp->pp_link = NULL;
 	}
-	/* Lab6  TODO:
-	 * 
-	 * modify your implementation to avoid adding the page at
-	 * MPENTRY_PADDR to the free list, so that we can safely
-	 * copy and run AP bootstrap code at that physical address
-	 *
-	 */
-
-	//4) Then extended memory [EXTPHYSMEM, ...).
-	int used_pages = boot_alloc(0);
-	i = PGNUM(EXTPHYSMEM);
-	for(i;i<npages;i++)
+	spin_unlock(&zero_lock);
+	return pp;
+}
+
+//
+// Give the whole pool of pre-zeroed pages back to the buddy allocator,
+// so they can merge into bigger blocks again.  Returns the number of
+// pages given back.
+//
+static int
+zero_pages_drain(void)
+{
+	struct PageInfo *pp, *list;
+	int n = 0;
+
+	spin_lock(&zero_lock);
+	list = zero_pages;
+	zero_pages = NULL;
+	num_zero_pages = 0;
+	spin_unlock(&zero_lock);
+
+	spin_lock(&page_lock);
+	while ((pp = list))
 	{
-		if(i<PGNUM(PADDR(used_pages)))
-		{
-			pages[i].pp_link = 0;
-			pages[i].pp_ref = 1;
-			continue;
-		}
-		pages[i].pp_ref = 0;
-        pages[i].pp_link = page_free_list;
-        page_free_list = &pages[i];
-        num_free_pages++;
+		list = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+		n++;
 	}
-	///////////////////////////////////
-	// page_free_list = NULL;
-	// int i;
- //    for (i = 0; i < npages; i++) {
- //        if(i == 0 || i == PGNUM(MPENTRY_PADDR)) {
- //            pages[i].pp_ref = 1;
- //            pages[i].pp_link = NULL;
- //        } else if(i < npages_basemem) {
- //            pages[i].pp_ref = 0;
- //            pages[i].pp_link = page_free_list;
- //            page_free_list = &pages[i];
- //            num_free_pages++;
- //        } else if(i < (EXTPHYSMEM / PGSIZE)) {
- //            pages[i].pp_ref = 1;
- //            pages[i].pp_link = NULL;
- //        } else {
- //            if(i < ((uint32_t)nextfree - KERNBASE) / PGSIZE) {
- //                pages[i].pp_ref = 1;
- //                pages[i].pp_link = NULL;
- //            } else {
- //                pages[i].pp_ref = 0;
- //                pages[i].pp_link = page_free_list;
- //                page_free_list = &pages[i];
- //                num_free_pages++;
- //            }
- //        }
- //    }
+	spin_unlock(&page_lock);
+	return n;
+}
+
+//
+// Clear up to PREZERO_BATCH free pages and add them to the pool that
+// ALLOC_ZERO allocations are served from, keeping at most PREZERO_HIGH
+// there.  Idle CPUs call this, so the memset is off everybody's
+// critical path.  With memory short (PREZERO_MIN_FREE) the pages stay
+// where bigger blocks can be made of them.  Returns the number of pages
+// cleared.
+//
+int
+page_prezero(void)
+{
+	struct PageCache *pc = &thiscpu->cpu_pgcache;
+	struct PageInfo *pp;
+	int n;
+
+	for (n = 0; n < PREZERO_BATCH && num_zero_pages < PREZERO_HIGH &&
+	     num_free_pages > PREZERO_MIN_FREE; n++)
+	{
+		if (!(pp = page_cache_pop(pc)))
+			break;
+		memset(page2kva(pp), '\0', PGSIZE);
+		spin_lock(&zero_lock);
+		pp->pp_link = zero_pages;
+		zero_pages = pp;
+		num_zero_pages++;
+		spin_unlock(&zero_lock);
+	}
+	return n;
 }
 
 //
@@ -395,50 +615,101 @@ page_init(void)
 //
 // Returns NULL if out of free memory.
 //
+// Pages come from this CPU's cache, which is refilled from the global
+// free list in batches.  Only the owning CPU touches its cache and the
+// kernel runs with interrupts disabled, so the cache needs no lock.
+// ALLOC_ZERO requests are served from the pre-zeroed pool first, and
+// that pool is the last resort for the others.
+//
 // Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-    /* TODO */
-	struct PageInfo* ans;
-	spin_lock(&page_lock);
-    if(!page_free_list) 
-    {
-		spin_unlock(&page_lock);
-    	return 0;
-    }
-	ans = page_free_list;
-	page_free_list = ans->pp_link;
-	spin_unlock(&page_lock);
-	ans->pp_link = 0;
-	if(alloc_flags & ALLOC_ZERO)
-		memset(page2kva(ans), '\0', PGSIZE);
-	num_free_pages--;
-	return ans;
+	struct PageInfo *pp;
+
+	if ((alloc_flags & ALLOC_ZERO) && (pp = zero_pages_pop()))
+		return pp;
+	if (!(pp = page_cache_pop(&thiscpu->cpu_pgcache)))
+		return zero_pages_pop();
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), '\0', PGSIZE);
+	return pp;
 }
 
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
 //
+// The page goes to this CPU's cache; once the cache grows past
+// PCP_HIGH, a batch is handed back to the global free list.
+//
 void
 page_free(struct PageInfo *pp)
 {
-	// Fill this function in
-	// Hint: You may want to panic if pp->pp_ref is nonzero or
-	// pp->pp_link is not NULL.
-    /* TODO */
-    if(pp->pp_ref!=0 || !pp)
-    	panic("pp->pp_ref is nonzero\n");
-    else 
-    {
-    	spin_lock(&page_lock);
-    	pp->pp_link = page_free_list;
-    	page_free_list = pp;
-    	spin_unlock(&page_lock);
-    	num_free_pages++;
-    	//cprintf("QQQ\n");
-    }
+	struct PageCache *pc;
+
+	if (!pp || pp->pp_ref != 0)
+		panic("pp->pp_ref is nonzero\n");
+
+	pc = &thiscpu->cpu_pgcache;
+	pp->pp_link = pc->pc_free;
+	pc->pc_free = pp;
+	if (++pc->pc_count > PCP_HIGH)
+		page_cache_drain(pc, PCP_HIGH - PCP_BATCH);
+}
+
+//
+// Allocates a physically contiguous block of 2^order pages, aligned to
+// its size, and returns the PageInfo of its first page.  Order 0 goes
+// through page_alloc.  As with page_alloc, ALLOC_ZERO clears the whole
+// block and no reference counts are touched.
+//
+// Returns NULL if no block that large is free, even once the pool of
+// pre-zeroed pages is given back.
+//
+struct PageInfo *
+alloc_pages(int alloc_flags, int order)
+{
+	struct PageInfo *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order < 0 || order >= MAX_ORDER)
+		return NULL;
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (!pp && zero_pages_drain() > 0)
+	{
+		spin_lock(&page_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+	}
+	if (!pp)
+		return NULL;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), '\0', PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block obtained from alloc_pages with the same order.
+//
+void
+free_pages(struct PageInfo *pp, int order)
+{
+	if (order == 0)
+	{
+		page_free(pp);
+		return;
+	}
+	if (!pp || pp->pp_ref != 0)
+		panic("free_pages: block is still referenced\n");
+
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
 }
 
 //
@@ -448,7 +719,7 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (page_ref_dec(pp))
 		page_free(pp);
 }
 
@@ -473,6 +744,7 @@ page_decref(struct PageInfo* pp)
 //
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
+// A 4MB page has no page table; for those the PDE itself is returned.
 //
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
@@ -491,9 +763,14 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	    	new_page->pp_ref++;
 	    	physaddr_t new_page_address = page2pa(new_page);
 	    	pgdir[PDX(va)] = new_page_address | PTE_P | PTE_W | PTE_U;
+	    	if (!PDE_SHARED(PDX(va)))
+	    		PGDIR_INFO(pgdir)->pi_ptmap[PDX(va) / 32] |= 1 << (PDX(va) % 32);
 	    }
 	}
 
+	if (pgdir[PDX(va)] & PTE_PS)
+		return &pgdir[PDX(va)];
+
 	//PDX -> directory index
 	//PTE_ADDR -> Address in page table or page directory entry
 	//KADDR -> kernel physical address to virtual address.
@@ -529,6 +806,34 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
     }
 }
 
+//
+// Like boot_map_region, but uses 4MB pages for every PTSIZE-aligned
+// part of the range if the CPU supports them (kern_cr4 has CR4_PSE).
+// va and pa must be equally aligned within a 4MB page.
+//
+static void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	size_t n;
+
+	while (size > 0)
+	{
+		if ((kern_cr4 & CR4_PSE) && va % PTSIZE == 0 && size >= PTSIZE)
+		{
+			pgdir[PDX(va)] = pa | perm | PTE_PS | PTE_P;
+			n = PTSIZE;
+		}
+		else
+		{
+			n = MIN(size, ROUNDUP(va + 1, PTSIZE) - va);
+			boot_map_region(pgdir, va, n, pa, perm);
+		}
+		pa += n;
+		va += n;
+		size -= n;
+	}
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -562,12 +867,10 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
     pte_t *entry = pgdir_walk(pgdir, va, 1);
     if(entry==NULL)
 		return - E_NO_MEM;
-    pp->pp_ref++;
+    page_ref_inc(pp);
+    // page_remove shoots the old mapping down
     if(*entry & PTE_P)
-    {
     	page_remove(pgdir, va);
-		tlb_invalidate(pgdir, va);
-    }
 
     physaddr_t physical_address= page2pa(pp);
     *entry = (physical_address) | perm |PTE_P;
@@ -595,7 +898,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
     if(pte_store!=0)
     	*pte_store = page_table_entry;
 
-    if(page_table_entry)
+    if(page_table_entry && (*page_table_entry & PTE_P))
     {
 	    // cprintf("page_table_entry: %u\n",PTE_ADDR(*page_table_entry));
     	return pa2page(PTE_ADDR(*page_table_entry));
@@ -630,20 +933,41 @@ page_remove(pde_t *pgdir, void *va)
     // cprintf("!!!!!!!!!%u\n",pte_store);
     if(information==NULL)
     	return;
+    // No CPU may still reach the page through us once it can be freed:
+    // clear the entry, then flush the TLBs, then drop the reference
+    *pte_store = 0;
     tlb_invalidate(pgdir, va);		//TLB  invalidated
     page_decref(information);		//The ref count on the physical page should decrement.
-    *pte_store = 0;
 }
 
+/*
+ * Drop every user page mapped in 'pgdir' and free its user page
+ * tables (the shared kernel ones stay).  Only the page tables noted
+ * in the PgdirInfo are visited, so the cost follows what the address
+ * space mapped, not its size.  'pgdir' must not be loaded on any CPU,
+ * so there are no TLB entries to shoot down.
+ */
 void
 ptable_remove(pde_t *pgdir)
 {
-  int i;
-  /* Free Page Tables */
-  for (i = 0; i < 1024; i++)
+  uint32_t *ptmap = PGDIR_INFO(pgdir)->pi_ptmap;
+  uint32_t bits;
+  pte_t *pt;
+  int i, j, k;
+
+  for (i = 0; i < PDX(UTOP); i += 32)
   {
-    if (pgdir[i] & PTE_P)
-      page_decref(pa2page(PTE_ADDR(pgdir[i])));
+    for (bits = ptmap[i / 32]; bits; bits &= bits - 1)
+    {
+      j = i + __builtin_ctz(bits);
+      pt = KADDR(PTE_ADDR(pgdir[j]));
+      for (k = 0; k < NPTENTRIES; k++)
+        if (pt[k] & PTE_P)
+          page_decref(pa2page(PTE_ADDR(pt[k])));
+      page_decref(pa2page(PTE_ADDR(pgdir[j])));
+      pgdir[j] = 0;
+    }
+    ptmap[i / 32] = 0;
   }
 }
 
@@ -651,19 +975,183 @@ ptable_remove(pde_t *pgdir)
 void
 pgdir_remove(pde_t *pgdir)
 {
-  page_free(pa2page(PADDR(pgdir)));
+  free_pages(pa2page(PADDR(pgdir)), PGDIR_ORDER);
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Invalidate a TLB entry, on every CPU that may have it cached.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	// For now, there is only one address space, so always invalidate.
-	invlpg(va);
+	tlb_shootdown(pgdir, va, 1);
+}
+
+//
+// Drop this CPU's TLB entries for 'npages' pages from 'va'.  Global
+// entries survive a CR3 reload, so flushing kernel mappings whole
+// means turning CR4_PGE off and on again.
+//
+static void
+tlb_flush(uintptr_t va, uint32_t npages, int global)
+{
+	uint32_t cr4;
+
+	if (npages <= TLB_INVLPG_MAX)
+	{
+		for (; npages > 0; npages--, va += PGSIZE)
+			invlpg((void *)va);
+	}
+	else if (global && ((cr4 = rcr4()) & CR4_PGE))
+	{
+		lcr4(cr4 & ~CR4_PGE);
+		lcr4(cr4);
+	}
+	else
+		lcr3(rcr3());
+}
+
+//
+// Run the shootdown requests other CPUs have posted for this one.
+// Called from the T_TLBFLUSH interrupt, and polled by CPUs that spin
+// with interrupts off, so that two CPUs waiting on each other (or on
+// a lock the other holds) can't deadlock.
+//
+void
+tlb_shootdown_poll(void)
+{
+	struct CpuInfo *c = thiscpu;
+	struct TlbShootdown *req;
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+	{
+		if (!c->cpu_tlb.tlb_pending[i])
+			continue;
+		req = &cpus[i].cpu_tlb;
+		// Loading another pgdir since has flushed its entries already
+		if (req->tlb_global || rcr3() == PADDR(req->tlb_pgdir))
+			tlb_flush(req->tlb_va, req->tlb_npages, req->tlb_global);
+		c->cpu_stat[CPU_STAT_SHOOTDOWNS_RECV]++;
+		c->cpu_tlb.tlb_pending[i] = 0;
+	}
+}
+
+//
+// Invalidate the mappings of 'npages' pages from 'va' in 'pgdir' on
+// every CPU, after the page table entries have been changed.  Only the
+// CPUs that have 'pgdir' loaded get an IPI, unless the pages are in
+// the kernel half every address space shares; either way each of them
+// gets a single IPI for the whole range.  Returns once all of them
+// have flushed.
+//
+void
+tlb_shootdown(pde_t *pgdir, void *va, size_t npages)
+{
+	struct CpuInfo *c = thiscpu, *o;
+	int global = pgdir == kern_pgdir || PDE_SHARED(PDX(va));
+	int i;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (global || rcr3() == PADDR(pgdir))
+		tlb_flush((uintptr_t)va, npages, global);
+
+	c->cpu_tlb.tlb_pgdir = pgdir;
+	c->cpu_tlb.tlb_va = (uintptr_t)va;
+	c->cpu_tlb.tlb_npages = npages;
+	c->cpu_tlb.tlb_global = global;
+	// the PTE stores above must be visible before we read cpu_pgdir,
+	// or a CPU switching to 'pgdir' right now could be missed and
+	// still walk the old entries (pairs with load_pgdir)
+	asm volatile("mfence" ::: "memory");
+	for (i = 0; i < ncpu; i++)
+	{
+		o = &cpus[i];
+		if (o == c || o->cpu_status != CPU_STARTED)
+			continue;
+		if (!global && o->cpu_pgdir != pgdir)
+			continue;
+		o->cpu_tlb.tlb_pending[c->cpu_id] = 1;
+		lapic_ipi_cpu(o->cpu_id, T_TLBFLUSH);
+		c->cpu_stat[CPU_STAT_SHOOTDOWNS_SENT]++;
+	}
+
+	for (i = 0; i < ncpu; i++)
+		while (cpus[i].cpu_tlb.tlb_pending[c->cpu_id])
+		{
+			tlb_shootdown_poll();
+			asm volatile ("pause");
+		}
+}
+
+//
+// Map the page at 'va' in 'src' into 'dst' at the same address without
+// copying it.  A writable page loses PTE_W and gains PTE_COW in both
+// page tables, so whichever side writes first gets its own copy.
+//
+// 'src' may still have the page cached writable in the TLB; the caller
+// has to tlb_shootdown it, which fork does once for the whole stack.
+//
+// RETURNS:
+//   0 on success (or if nothing is mapped at 'va')
+//   -E_NO_MEM, if page table couldn't be allocated
+//
+int
+page_share_cow(pde_t *dst, pde_t *src, void *va)
+{
+	pte_t *pte = pgdir_walk(src, va, 0);
+	int perm;
+
+	if (!pte || !(*pte & PTE_P))
+		return 0;
+	perm = *pte & (PTE_SYSCALL & ~PTE_P);
+	if (perm & (PTE_W | PTE_COW))
+	{
+		perm = (perm & ~PTE_W) | PTE_COW;
+		*pte = PTE_ADDR(*pte) | perm | PTE_P;
+	}
+	return page_insert(dst, pa2page(PTE_ADDR(*pte)), va, perm);
+}
+
+//
+// Resolve a write fault on a PTE_COW page of 'pgdir'.  The last
+// sharer just gets write access back; anybody else writes to a fresh
+// copy of the page.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 'va' is not a copy-on-write page
+//   -E_NO_MEM, if there's no memory for the copy
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	pte_t *pte = pgdir_walk(pgdir, va, 0);
+	struct PageInfo *pp, *npp;
+	int perm;
+
+	if (!pte || (*pte & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+		return -E_INVAL;
+	va = ROUNDDOWN(va, PGSIZE);
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = ((*pte & (PTE_SYSCALL & ~PTE_P)) & ~PTE_COW) | PTE_W;
+
+	// Every other sharer clears its entry and flushes it before its
+	// reference goes (see page_remove), and only this task's own
+	// fork could share the page again, so a count of 1 means the
+	// page is ours alone
+	if (pp->pp_ref == 1)
+	{
+		*pte = PTE_ADDR(*pte) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (!(npp = page_alloc(0)))
+		return -E_NO_MEM;
+	memcpy(page2kva(npp), page2kva(pp), PGSIZE);
+	// page_insert drops our reference to the shared page
+	return page_insert(pgdir, npp, va, perm);
 }
 
 //
@@ -701,20 +1189,48 @@ mmio_map_region(physaddr_t pa, size_t size)
 	// Your code here:
 	if(base+ROUNDUP(size, PGSIZE) > MMIOLIM)
 		panic("mmio_map_region not implemented");
-    boot_map_region(kern_pgdir, base, ROUNDUP(size, PGSIZE), pa, PTE_PCD | PTE_PWT | PTE_W);
+    boot_map_region(kern_pgdir, base, ROUNDUP(size, PGSIZE), pa, PTE_PCD | PTE_PWT | PTE_W | PTE_G);
     uintptr_t mp_base = base;
     base += ROUNDUP(size, PGSIZE);
     return mp_base;
 }
 
 /* This is a simple wrapper function for mapping user program */
+/* The user image is the same in every address space, so it is global too;
+ * its kernel-only TLB entries have to go, a CR3 load won't drop them */
 void
 setupvm(pde_t *pgdir, uint32_t start, uint32_t size)
 {
-  boot_map_region(pgdir, start, ROUNDUP(size, PGSIZE), PADDR((void*)start), PTE_W | PTE_U);
+  uint32_t va;
+
+  boot_map_region(pgdir, start, ROUNDUP(size, PGSIZE), PADDR((void*)start), PTE_W | PTE_U | PTE_G);
+  for (va = start; va < start + size; va += PGSIZE)
+    tlb_invalidate(pgdir, (void *)va);
   assert(check_va2pa(pgdir, start) == PADDR((void*)start));
 }
 
+//
+// Switch this CPU to the address space 'pgdir'.  Reloading the CR3
+// that is already loaded would only flush the TLB for nothing, so
+// that is skipped; every real load is counted in CPU_STAT_CR3_LOADS.
+// cpu_pgdir tells tlb_shootdown which CPUs to interrupt; it is set and
+// made visible before the new page tables can be walked, so a
+// shootdown racing with the switch either sees it or its changes are
+// already there to be walked.
+//
+void
+load_pgdir(pde_t *pgdir)
+{
+  physaddr_t pa = PADDR(pgdir);
+
+  thiscpu->cpu_pgdir = pgdir;
+  asm volatile("mfence" ::: "memory");
+  if (rcr3() == pa)
+    return;
+  lcr3(pa);
+  thiscpu->cpu_stat[CPU_STAT_CR3_LOADS]++;
+}
+
 
 /* TODO: Lab 5 
  * Set up kernel part of a page table.
@@ -731,34 +1247,23 @@ pde_t *
 setupkvm()
 {
 	pde_t *new_pgdir=NULL;
-	struct PageInfo* p = page_alloc(ALLOC_ZERO);
+	struct PageInfo* p = alloc_pages(0, PGDIR_ORDER);
 	if( !p )
 		return NULL;
 	
 	new_pgdir = page2kva(p);
-	// int i;
-	// for(i = 0 ; i < 1024 ; i++)
-	// {
-	// 	new_pgdir[i] = kern_pgdir[i];
-	// 	if(new_pgdir[i] & PTE_P)
-	// 		pa2page(PTE_ADDR(new_pgdir[i]))->pp_ref++;
-	// }
-	boot_map_region(new_pgdir, UPAGES, ROUNDUP((sizeof(struct PageInfo) * npages), \
-    				PGSIZE), PADDR(pages), (PTE_U | PTE_P));
-    // boot_map_region(new_pgdir, KSTACKTOP-KSTKSIZE, ROUNDUP(KSTKSIZE, PGSIZE), PADDR(bootstack), (PTE_W | PTE_P));
-	boot_map_region(new_pgdir, KERNBASE, ROUNDUP(2^32 - KERNBASE, PGSIZE), 0, (PTE_W | PTE_P));
-    boot_map_region(new_pgdir, IOPHYSMEM, ROUNDUP((EXTPHYSMEM - IOPHYSMEM), PGSIZE), IOPHYSMEM, (PTE_W) | (PTE_P));
-
-	int temp = KSTACKTOP;
-    int i=0;
-    for(i; i < NCPU ; i++){
-        boot_map_region(kern_pgdir, temp - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_P);
-        temp = temp-(KSTKSIZE+KSTKGAP);
-    }
+	memset(PGDIR_INFO(new_pgdir), 0, sizeof(struct PgdirInfo));
 
-	// boot_map_region(new_pgdir, MMIOBASE, ROUNDUP(4096,PGSIZE), PADDR(lapicaddr), PTE_PCD|PTE_PWT|PTE_W);
-	extern uint32_t *lapic;
-	boot_map_region(new_pgdir, lapic, ROUNDUP(4096,PGSIZE), lapicaddr, PTE_PCD|PTE_PWT|PTE_W);
+	// The kernel half (UPAGES, the per-CPU kernel stacks, the MMIO
+	// region, all of physical memory and the user image linked into
+	// the kernel) is built once in kern_pgdir by mem_init and
+	// task_init.  Share its page tables instead of building our own.
+	int i;
+	for (i = 0; i < NPDENTRIES; i++)
+		new_pgdir[i] = PDE_SHARED(i) ? kern_pgdir[i] : 0;
+
+	// UVPT maps this page directory itself
+	new_pgdir[PDX(UVPT)] = PADDR(new_pgdir) | PTE_U | PTE_P;
 	return new_pgdir;	
 }
 
@@ -766,17 +1271,34 @@ setupkvm()
  * Please maintain num_free_pages yourself
  */
 /* This is the system call implementation of get_num_free_page */
+/* Free pages are those on the global list, every CPU's cache and the
+ * pre-zeroed pool */
 int32_t
 sys_get_num_free_page(void)
 {
-  return num_free_pages;
+  int32_t nfree = num_free_pages + num_zero_pages;
+  int i;
+
+  for (i = 0; i < NCPU; i++)
+    nfree += cpus[i].cpu_pgcache.pc_count;
+  return nfree;
+}
+
+/* This is the system call implementation of get_num_free_block */
+/* Number of free blocks of 2^order pages, or -1 past the last order */
+int32_t
+sys_get_num_free_block(int order)
+{
+  if (order < 0 || order >= MAX_ORDER)
+    return -1;
+  return free_blocks[order];
 }
 
 /* This is the system call implementation of get_num_used_page */
 int32_t
 sys_get_num_used_page(void)
 {
-  return npages - num_free_pages; 
+  return npages - sys_get_num_free_page();
 }
 
 // --------------------------------------------------------------
@@ -784,64 +1306,113 @@ sys_get_num_used_page(void)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// The checks below need to run the allocator dry.  free_stash takes
+// every free block away from the buddy allocator (after flushing this
+// CPU's cache) and free_unstash gives them back.  Pages freed in
+// between stay in the cache, so they never meet a stashed buddy.
+//
+struct free_stash {
+	struct PageInfo *area[MAX_ORDER];
+	size_t blocks[MAX_ORDER];
+	size_t nfree;
+};
+
+static void
+free_stash(struct free_stash *st)
+{
+	int order;
+
+	page_cache_drain(&thiscpu->cpu_pgcache, 0);
+	for (order = 0; order < MAX_ORDER; order++) {
+		st->area[order] = free_area[order];
+		st->blocks[order] = free_blocks[order];
+		free_area[order] = NULL;
+		free_blocks[order] = 0;
+	}
+	st->nfree = num_free_pages;
+	num_free_pages = 0;
+}
+
+static void
+free_unstash(struct free_stash *st)
+{
+	int order;
+
+	for (order = 0; order < MAX_ORDER; order++) {
+		assert(!free_area[order]);
+		free_area[order] = st->area[order];
+		free_blocks[order] = st->blocks[order];
+	}
+	num_free_pages = st->nfree;
+}
+
+//
+// Check that the pages on the buddy free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *blk, *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
+	size_t nfree = 0, nblocks;
 	char *first_free_page;
+	int order, i;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	// Cached pages are free too; put them back on the lists to be checked
+	page_cache_drain(&thiscpu->cpu_pgcache, 0);
+	if (!num_free_pages)
+		panic("no free pages on the buddy free lists!");
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (order = 0; order < MAX_ORDER; order++)
+		for (blk = free_area[order]; blk; blk = blk->pp_link)
+			for (i = 0; i < (1 << order); i++)
+				if (PDX(page2pa(blk + i)) < pdx_limit)
+					memset(page2kva(blk + i), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-    		// (new test for Lab6)
-    		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (order = 0; order < MAX_ORDER; order++) {
+		nblocks = 0;
+		for (blk = free_area[order]; blk; blk = blk->pp_link) {
+			// check that we didn't corrupt the free list itself
+			assert(blk >= pages);
+			assert(blk + (1 << order) <= pages + npages);
+			assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+			assert(blk->pp_flags & PP_BUDDY);
+			assert(blk->pp_order == order);
+			assert(!blk->pp_link || blk->pp_link->pp_prev == blk);
+			// blocks are aligned to their size
+			assert(((blk - pages) & ((1 << order) - 1)) == 0);
+			nblocks++;
+
+			for (i = 0; i < (1 << order); i++) {
+				pp = blk + i;
+
+				// check a few pages that shouldn't be on the free list
+				assert(pp->pp_ref == 0);
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+    				// (new test for Lab6)
+    				assert(page2pa(pp) != MPENTRY_PADDR);
+
+				if (page2pa(pp) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+				nfree++;
+			}
+		}
+		assert(nblocks == free_blocks[order]);
 	}
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
+	assert(nfree == num_free_pages);
 	printk("check_page_free_list() succeeded!\n");
 }
 
@@ -854,7 +1425,7 @@ check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct PageInfo *fl;
+	struct free_stash fl;
 	char *c;
 	int i;
 
@@ -862,8 +1433,8 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	page_cache_drain(&thiscpu->cpu_pgcache, 0);
+	nfree = num_free_pages;
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -879,11 +1450,11 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 // cprintf("!!\n");
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	free_stash(&fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
+	assert(!alloc_pages(0, 1));
 
 	// free and re-allocate?
 	page_free(pp0);
@@ -907,7 +1478,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	free_unstash(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -915,13 +1486,138 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	page_cache_drain(&thiscpu->cpu_pgcache, 0);
+	assert(nfree == num_free_pages);
 
 	printk("check_page_alloc() succeeded!\n");
 }
 
+//
+// Check multi-page allocations and coalescing in the buddy allocator.
+//
+static void
+check_buddy(void)
+{
+	struct PageInfo *pp, *pp0, *pp1;
+	size_t blocks[MAX_ORDER];
+	size_t nfree;
+	int order;
+
+	page_cache_drain(&thiscpu->cpu_pgcache, 0);
+	nfree = num_free_pages;
+	memmove(blocks, free_blocks, sizeof(blocks));
+
+	// every order can be allocated, aligned to its size
+	for (order = 1; order < MAX_ORDER; order++) {
+		assert((pp = alloc_pages(0, order)));
+		assert(((pp - pages) & ((1 << order) - 1)) == 0);
+		assert(!(pp->pp_flags & PP_BUDDY));
+		assert(num_free_pages == nfree - (1 << order));
+		free_pages(pp, order);
+		assert(num_free_pages == nfree);
+	}
+
+	// ALLOC_ZERO clears the whole block
+	assert((pp = alloc_pages(0, 2)));
+	memset(page2kva(pp), 0x97, 4 * PGSIZE);
+	free_pages(pp, 2);
+	assert((pp0 = alloc_pages(ALLOC_ZERO, 2)) == pp);
+	assert(*(uint32_t *) ((char *) page2kva(pp0) + 4 * PGSIZE - 4) == 0);
+
+	// freeing the two halves of a block separately merges them again
+	free_pages(pp0, 1);
+	free_pages(pp0 + 2, 1);
+	assert((pp1 = alloc_pages(0, 2)) == pp0);
+	free_pages(pp1, 2);
+
+	// the free lists look exactly as they did before
+	assert(num_free_pages == nfree);
+	assert(memcmp(blocks, free_blocks, sizeof(blocks)) == 0);
+
+	printk("check_buddy() succeeded!\n");
+}
+
+//
+// Check the per-CPU page cache in front of the free list.
+//
+static void
+check_page_cache(void)
+{
+	struct PageCache *pc = &thiscpu->cpu_pgcache;
+	struct PageInfo *pp, *held = NULL;
+	int nfree, i;
+
+	page_cache_drain(pc, 0);
+	nfree = sys_get_num_free_page();
+
+	// an empty cache is refilled a whole batch at a time
+	assert((pp = page_alloc(0)));
+	assert(pc->pc_count == PCP_BATCH - 1);
+	assert(sys_get_num_free_page() == nfree - 1);
+	page_free(pp);
+	assert(pc->pc_count == PCP_BATCH);
+
+	// hold more pages than the cache may keep, then free them all
+	for (i = 0; i < PCP_HIGH + PCP_BATCH; i++) {
+		assert((pp = page_alloc(0)));
+		pp->pp_link = held;
+		held = pp;
+	}
+	assert(sys_get_num_free_page() == nfree - (PCP_HIGH + PCP_BATCH));
+	while (held) {
+		pp = held;
+		held = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+
+	// the cache drained itself and nothing was lost on the way
+	assert(pc->pc_count <= PCP_HIGH);
+	assert(sys_get_num_free_page() == nfree);
+
+	printk("check_page_cache() succeeded!\n");
+}
+
+//
+// Check the pool of pre-zeroed pages.
+//
+static void
+check_page_prezero(void)
+{
+	struct PageInfo *pp;
+	int nfree, n, i;
+	char *p;
+
+	nfree = sys_get_num_free_page();
+	assert(num_zero_pages == 0);
+
+	// dirty a page, so it is one of those that get cleared
+	assert((pp = page_alloc(0)));
+	memset(page2kva(pp), 0x5a, PGSIZE);
+	page_free(pp);
+
+	assert((n = page_prezero()) == PREZERO_BATCH);
+	assert(num_zero_pages == n);
+	assert(sys_get_num_free_page() == nfree);
+
+	// ALLOC_ZERO takes from the pool, everything else leaves it alone
+	assert((pp = page_alloc(0)));
+	assert(num_zero_pages == n);
+	page_free(pp);
+	assert((pp = page_alloc(ALLOC_ZERO)));
+	assert(num_zero_pages == n - 1);
+	for (p = page2kva(pp), i = 0; i < PGSIZE; i++)
+		assert(p[i] == 0);
+	page_free(pp);
+
+	// give the pool back, the later checks count on the free lists
+	while ((pp = zero_pages_pop()))
+		page_free(pp);
+	assert(sys_get_num_free_page() == nfree);
+
+	printk("check_page_prezero() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been setup roughly correctly (by mem_init()).
@@ -998,6 +1694,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (va & (PTSIZE - 1));
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	// cprintf("*******%u\n",&p[PTX(va)]);
 	if (!(p[PTX(va)] & PTE_P))
@@ -1011,7 +1709,7 @@ static void
 check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
+	struct free_stash fl;
 	pte_t *ptep, *ptep1;
   	uintptr_t mm1, mm2;
 	void *va;
@@ -1028,8 +1726,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	free_stash(&fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1161,7 +1858,7 @@ check_page(void)
 
 	// cprintf("BBBBBBBBBBBBBBBBBBB\n");
 	// give free list back
-	page_free_list = fl;
+	free_unstash(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1225,3 +1922,53 @@ check_page_installed_pgdir(void)
 	printk("check_page_installed_pgdir() succeeded!\n");
 }
 
+// check page_share_cow and page_cow_fault with the kernel's page
+// directory as the parent and an empty one as the child
+static void
+check_page_cow(void)
+{
+	struct PageInfo *pp, *pd;
+	pde_t *pgdir;
+	pte_t *pte;
+	void *va = (void *) EXTPHYSMEM;
+
+	assert((pd = alloc_pages(ALLOC_ZERO, PGDIR_ORDER)));
+	pgdir = page2kva(pd);
+	assert((pp = page_alloc(0)));
+	memset(page2kva(pp), 1, PGSIZE);
+	assert(page_insert(kern_pgdir, pp, va, PTE_W) == 0);
+
+	// sharing write-protects both mappings
+	assert(page_share_cow(pgdir, kern_pgdir, va) == 0);
+	tlb_shootdown(kern_pgdir, va, 1);
+	assert(pp->pp_ref == 2);
+	assert((*pgdir_walk(kern_pgdir, va, 0) & (PTE_W | PTE_COW)) == PTE_COW);
+	assert((*pgdir_walk(pgdir, va, 0) & (PTE_W | PTE_COW)) == PTE_COW);
+	assert(*(uint32_t *)va == 0x01010101U);
+
+	// the first writer gets a copy...
+	assert(page_cow_fault(kern_pgdir, va) == 0);
+	assert(pp->pp_ref == 1);
+	pte = pgdir_walk(kern_pgdir, va, 0);
+	assert(PTE_ADDR(*pte) != page2pa(pp));
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+	*(uint32_t *)va = 0x02020202U;
+	assert(*(uint32_t *)page2kva(pp) == 0x01010101U);
+
+	// ...and the last sharer keeps the original page
+	assert(page_cow_fault(pgdir, va) == 0);
+	pte = pgdir_walk(pgdir, va, 0);
+	assert(PTE_ADDR(*pte) == page2pa(pp));
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+	assert(page_cow_fault(pgdir, va) == -E_INVAL);
+
+	// clean up
+	page_remove(kern_pgdir, va);
+	page_remove(pgdir, va);
+	assert(pp->pp_ref == 0);
+	// (ptable_remove leaves the IO hole's page table alone)
+	page_decref(pa2page(PTE_ADDR(pgdir[PDX(va)])));
+	pgdir_remove(pgdir);
+
+	printk("check_page_cow() succeeded!\n");
+}
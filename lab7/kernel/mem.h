@@ -8,6 +8,7 @@ extern char             bootstacktop[], bootstack[];
 extern struct PageInfo  *pages;
 extern size_t           npages;
 extern pde_t            *kern_pgdir;
+extern uint32_t         kern_cr4;
 
 /* This macro takes a kernel virtual address -- an address that points above
  * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
@@ -25,6 +26,43 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// After fork() parent and child share their writable user pages
+// read-only, marked PTE_COW; the first write to such a page gives the
+// writer a private copy (see page_cow_fault).
+#define PTE_COW		0x800	// one of the PTE_AVAIL bits
+
+// Free memory is managed by a buddy allocator in blocks of 2^order
+// pages, order 0 (4KB) up to MAX_ORDER-1 (4MB, one large page).
+#define MAX_ORDER	11
+
+// Each CPU keeps a small cache of free pages in front of the global
+// free list, so page_alloc/page_free only take page_lock once every
+// PCP_BATCH pages.
+#define PCP_BATCH	16	// pages moved between a cache and the free list at once
+#define PCP_HIGH	64	// a cache holding more than this is drained
+
+// Idle CPUs clear free pages ahead of time in sched_idle, PREZERO_BATCH
+// per page_prezero call, so that ALLOC_ZERO allocations (page tables, page
+// directories, fresh stack pages) usually skip the memset.
+#define PREZERO_BATCH	8	// pages cleared per page_prezero call
+#define PREZERO_HIGH	256	// most pre-zeroed pages kept
+#define PREZERO_MIN_FREE	(2 * PREZERO_HIGH)	// no clearing with fewer free
+
+struct PageCache {
+	struct PageInfo *pc_free;	// LIFO list of cached free pages
+	int32_t pc_count;		// number of pages on pc_free
+};
+
+// Each page directory is followed by a page holding its PgdirInfo,
+// where pgdir_walk notes the user page tables it allocates, so that
+// ptable_remove only visits those.
+#define PGDIR_ORDER	1
+#define PGDIR_INFO(pgdir)	((struct PgdirInfo *) ((char *) (pgdir) + PGSIZE))
+
+struct PgdirInfo {
+	uint32_t pi_ptmap[NPDENTRIES / 32];	// bit i set: pgdir[i] is a user page table
+};
+
 /* -------------- Prototypes --------------  */
 
 void              mem_init                (void);
@@ -36,15 +74,24 @@ void	            ptable_remove           (pde_t *pgdir);
 void	            pgdir_remove            (pde_t *pgdir);
 void	            page_decref             (struct PageInfo *pp);
 struct PageInfo   *page_alloc             (int alloc_flags);
+int               page_prezero            (void);
+struct PageInfo   *alloc_pages            (int alloc_flags, int order);
+void              free_pages              (struct PageInfo *pp, int order);
 struct PageInfo   *page_lookup            (pde_t *pgdir, void *va, pte_t **pte_store);
 pde_t             *setupkvm               (void);
 void              setupvm                 (pde_t *pgdir, uint32_t start, uint32_t size);
 pte_t             *pgdir_walk             (pde_t *pgdir, const void *va, int create);
+void              load_pgdir              (pde_t *pgdir);
 void	            tlb_invalidate          (pde_t *pgdir, void *va);
+void              tlb_shootdown           (pde_t *pgdir, void *va, size_t npages);
+void              tlb_shootdown_poll      (void);
+int               page_share_cow          (pde_t *dst, pde_t *src, void *va);
+int               page_cow_fault          (pde_t *pgdir, void *va);
 void              mem_init                (void);
 
 int32_t           sys_get_num_free_page   (void);
 int32_t           sys_get_num_used_page   (void);
+int32_t           sys_get_num_free_block  (int order);
 
 
 /* -------------- Inline Functions --------------  */
@@ -79,6 +126,26 @@ pa2page(physaddr_t pa)
 	return &pages[PGNUM(pa)];
 }
 
+// Pages shared copy-on-write (see page_share_cow) are mapped and unmapped
+// by tasks on different CPUs at once, so pp_ref only changes with
+// locked instructions.
+static inline void
+page_ref_inc(struct PageInfo *pp)
+{
+	__asm __volatile("lock; incw %0" : "+m" (pp->pp_ref) : : "memory");
+}
+
+// Returns nonzero if that was the last reference
+static inline int
+page_ref_dec(struct PageInfo *pp)
+{
+	uint8_t zero;
+
+	__asm __volatile("lock; decw %0; sete %1"
+		: "+m" (pp->pp_ref), "=q" (zero) : : "memory", "cc");
+	return zero;
+}
+
 static inline void*
 page2kva(struct PageInfo *pp)
 {
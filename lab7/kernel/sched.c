@@ -1,10 +1,10 @@
 #include <kernel/task.h>
 #include <kernel/cpu.h>
+#include <kernel/mem.h>
+#include <kernel/xcall.h>
 #include <inc/x86.h>
 #include <kernel/spinlock.h>
-
-#define ctx_switch(ts) \
-  do { env_pop_tf(&((ts)->tf)); } while(0)
+#include <inc/string.h>
 
 /* TODO: Lab5
 * Implement a simple round-robin scheduler (Start with the next one)
@@ -18,7 +18,8 @@
 *    and set its state, remind_ticks, and change page
 *    directory to its pgdir.
 *
-* 4. CONTEXT SWITCH, leverage the macro ctx_switch(ts)
+* 4. CONTEXT SWITCH, from one kernel stack to the other with
+*    switch_to (kernel/switch.S).
 *    Please make sure you understand the mechanism.
 */
 
@@ -41,45 +42,951 @@
 //    (cpu can only schedule tasks which in its runqueue!!) 
 //    (do not schedule idle task if there are still another process can run)	
 //
-void sched_yield(void)
+extern Task tasks[];
+
+static void
+prio_array_add(struct PrioArray *pa, Task *ts)
+{
+	int prio = NICE_TO_PRIO(ts->nice);
+	struct PrioQueue *q = &pa->queue[prio];
+
+	ts->rq_next = NULL;
+	ts->rq_prev = q->tail;
+	if (q->tail)
+		q->tail->rq_next = ts;
+	else
+		q->head = ts;
+	q->tail = ts;
+	pa->bitmap[prio / 32] |= 1 << (prio % 32);
+	pa->nr_tasks++;
+	ts->rq_array = pa;
+}
+
+static void
+prio_array_del(struct PrioArray *pa, Task *ts)
 {
-	extern Task tasks[];
-	extern struct spinlock tasks_lock;
-	int id;
+	int prio = NICE_TO_PRIO(ts->nice);
+	struct PrioQueue *q = &pa->queue[prio];
 
-	if(thiscpu->cpu_task)
-		id = thiscpu->cpu_rq.current_index;
+	if (ts->rq_prev)
+		ts->rq_prev->rq_next = ts->rq_next;
+	else
+		q->head = ts->rq_next;
+	if (ts->rq_next)
+		ts->rq_next->rq_prev = ts->rq_prev;
 	else
-		id=0;
+		q->tail = ts->rq_prev;
+	if (!q->head)
+		pa->bitmap[prio / 32] &= ~(1 << (prio % 32));
+	pa->nr_tasks--;
+	ts->rq_next = ts->rq_prev = NULL;
+	ts->rq_array = NULL;
+}
 
+// The first task of the best non-empty priority, or NULL
+static Task *
+prio_array_first(struct PrioArray *pa)
+{
 	int i;
 
-	for (i=0;i<thiscpu->cpu_rq.total;i++)
+	for (i = 0; i < (NR_PRIO + 31) / 32; i++)
+		if (pa->bitmap[i])
+			return pa->queue[i * 32 + __builtin_ctz(pa->bitmap[i])].head;
+	return NULL;
+}
+
+// --------------------------------------------------------------
+// The priority class: the O(1) scheduler with its active and expired
+// arrays.  A task runs for its time slice, or until a task of a better
+// priority wakes up.
+// --------------------------------------------------------------
+
+static void
+prio_init(Runqueue *rq)
+{
+	rq->active = &rq->arrays[0];
+	rq->expired = &rq->arrays[1];
+}
+
+// Queue behind the tasks of the same priority that are already waiting
+static int
+prio_enqueue(Runqueue *rq, Task *ts, int wakeup)
+{
+	if (wakeup)
+		ts->remind_ticks = TASK_TIMESLICE(ts);
+	prio_array_add(rq->active, ts);
+	return 1;
+}
+
+static void
+prio_dequeue(Runqueue *rq, Task *ts)
+{
+	prio_array_del(ts->rq_array, ts);
+}
+
+// A task switched out waits for the arrays to swap, with a fresh slice
+static int
+prio_put_prev(Runqueue *rq, Task *ts)
+{
+	ts->remind_ticks = TASK_TIMESLICE(ts);
+	prio_array_add(rq->expired, ts);
+	return 1;
+}
+
+static Task *
+prio_pick_next(Runqueue *rq)
+{
+	struct PrioArray *pa;
+	Task *ts;
+
+	if (rq->active->nr_tasks == 0)
 	{
-		int pid = thiscpu->cpu_rq.runq[ (id+i+1)%thiscpu->cpu_rq.total ];
-		if(tasks[pid].state==TASK_RUNNABLE || tasks[pid].state==TASK_RUNNING)
+		pa = rq->active;
+		rq->active = rq->expired;
+		rq->expired = pa;
+	}
+	if ((ts = prio_array_first(rq->active)))
+		prio_array_del(rq->active, ts);
+	return ts;
+}
+
+static int
+prio_tick(Runqueue *rq, Task *cur, uint32_t ticks)
+{
+	cur->remind_ticks -= ticks;
+	return cur->remind_ticks <= 0;
+}
+
+static int
+prio_preempt(Runqueue *rq, Task *cur, Task *ts)
+{
+	return NICE_TO_PRIO(ts->nice) < NICE_TO_PRIO(cur->nice);
+}
+
+//
+// The expired array is searched first, since those tasks would wait
+// longest, and within a queue the tail, which would run last.
+//
+static Task *
+prio_pick_migratable(Runqueue *src, int hot_ok, int cpu)
+{
+	struct PrioArray *arrays[2] = { src->expired, src->active };
+	Task *ts;
+	int a, prio;
+
+	for (a = 0; a < 2; a++)
+		for (prio = 0; prio < NR_PRIO; prio++)
 		{
-			thiscpu->cpu_rq.current_index = (id+i+1)%thiscpu->cpu_rq.total;
-			id = pid;
+			if (!(arrays[a]->bitmap[prio / 32] & (1 << (prio % 32))))
+				continue;
+			for (ts = arrays[a]->queue[prio].tail; ts; ts = ts->rq_prev)
+				if ((hot_ok || !TASK_CACHE_HOT(src, ts)) &&
+				    TASK_ALLOWED(ts, cpu))
+					return ts;
+		}
+	return NULL;
+}
+
+struct SchedClass sched_prio = {
+	.name = "prio",
+	.init = prio_init,
+	.enqueue = prio_enqueue,
+	.dequeue = prio_dequeue,
+	.put_prev = prio_put_prev,
+	.pick_next = prio_pick_next,
+	.tick = prio_tick,
+	.preempt = prio_preempt,
+	.pick_migratable = prio_pick_migratable,
+};
+
+// --------------------------------------------------------------
+// Runqueues, whatever the class
+// --------------------------------------------------------------
+
+struct SchedClass *sched_class = &sched_prio;
+
+//
+// Pick the scheduling class named by SCHED_CLASS, which the Makefile
+// sets from SCHED; the priority class if there is no such class.
+//
+void
+sched_init(void)
+{
+	struct SchedClass *classes[] = { &sched_prio, &sched_cfs };
+	int i;
+
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+		if (strcmp(classes[i]->name, SCHED_CLASS) == 0)
+			sched_class = classes[i];
+	if (strcmp(sched_class->name, SCHED_CLASS) != 0)
+		printk("sched: no class %s, using %s\n", SCHED_CLASS, sched_class->name);
+	else
+		printk("sched: using the %s class\n", sched_class->name);
+}
+
+void
+rq_init(Runqueue *rq)
+{
+	memset(rq, 0, sizeof(*rq));
+	spin_initlock(&rq->lock);
+	rq->clock = timer_ticks();
+	sched_class->init(rq);
+	sched_dl.init(rq);
+}
+
+// Should the woken task 'ts' preempt 'cur'?  EDF tasks go before all
+// others; within a class the class decides.
+static int
+rq_preempts(Runqueue *rq, Task *cur, Task *ts)
+{
+	if (TASK_CLASS(ts) != TASK_CLASS(cur))
+		return TASK_CLASS(ts) == &sched_dl;
+	return TASK_CLASS(ts)->preempt(rq, cur, ts);
+}
+
+//
+// Queue the runnable task 'ts' on 'rq', unless its class holds it back
+// for now.  If it woke up on this CPU, it may preempt the running
+// task, at the next interrupt return (see sched_tick and
+// xcall_handler).
+//
+void
+rq_add(Runqueue *rq, Task *ts, int wakeup)
+{
+	Task *cur = thiscpu->cpu_task;
+
+	if (!TASK_CLASS(ts)->enqueue(rq, ts, wakeup))
+		return;
+	ts->on_rq = 1;
+	rq->nr_queued++;
+	if (wakeup && rq == &thiscpu->cpu_rq && cur && cur != rq->idle &&
+	    cur->state == TASK_RUNNING && rq_preempts(rq, cur, ts))
+		rq->need_resched = 1;
+}
+
+// The running task 'ts' is switched out and waits for its next turn
+static void
+rq_put_prev(Runqueue *rq, Task *ts)
+{
+	if (!TASK_CLASS(ts)->put_prev(rq, ts))
+		return;
+	ts->on_rq = 1;
+	rq->nr_queued++;
+}
+
+//
+// Put the sleeping task 'ts' on the timer wheel slot for its wake_at:
+// on level 0 if that is less than TW_SIZE ticks away, otherwise on the
+// first level whose slots reach that far.
+//
+static void
+tw_add(Runqueue *rq, Task *ts)
+{
+	uint32_t delta = ts->wake_at - rq->clock;
+	Task **slot;
+	int lvl;
+
+	if (delta > TW_MAX)
+		ts->wake_at = rq->clock + (delta = TW_MAX);
+	for (lvl = 0; lvl < TW_LEVELS - 1 && delta >> (TW_BITS * (lvl + 1)); lvl++)
+		;
+	slot = &rq->wheel.slot[lvl][(ts->wake_at >> (TW_BITS * lvl)) & (TW_SIZE - 1)];
+
+	ts->rq_prev = NULL;
+	ts->rq_next = *slot;
+	if (*slot)
+		(*slot)->rq_prev = ts;
+	*slot = ts;
+	ts->tw_slot = slot;
+}
+
+static void
+tw_del(Task *ts)
+{
+	if (ts->rq_prev)
+		ts->rq_prev->rq_next = ts->rq_next;
+	else
+		*ts->tw_slot = ts->rq_next;
+	if (ts->rq_next)
+		ts->rq_next->rq_prev = ts->rq_prev;
+	ts->rq_next = ts->rq_prev = NULL;
+	ts->tw_slot = NULL;
+}
+
+//
+// Advance the wheel to rq->clock: cascade the higher levels if level
+// 0 just wrapped around, then wake everybody in the level-0 slot.
+//
+static void
+tw_run(Runqueue *rq)
+{
+	Task *ts, *next;
+	int lvl, idx;
+
+	for (lvl = 1; lvl < TW_LEVELS; lvl++)
+	{
+		if (rq->clock & ((1 << (TW_BITS * lvl)) - 1))
 			break;
+		idx = (rq->clock >> (TW_BITS * lvl)) & (TW_SIZE - 1);
+		ts = rq->wheel.slot[lvl][idx];
+		rq->wheel.slot[lvl][idx] = NULL;
+		for (; ts; ts = next)
+		{
+			next = ts->rq_next;
+			tw_add(rq, ts);
+		}
+	}
+
+	ts = rq->wheel.slot[0][rq->clock & (TW_SIZE - 1)];
+	rq->wheel.slot[0][rq->clock & (TW_SIZE - 1)] = NULL;
+	for (; ts; ts = next)
+	{
+		next = ts->rq_next;
+		ts->rq_next = ts->rq_prev = NULL;
+		ts->tw_slot = NULL;
+		ts->state = TASK_RUNNABLE;
+		rq_add(rq, ts, 1);
+	}
+}
+
+//
+// Take 'ts' off whichever queue of 'rq' it is on (none if it is
+// running), or cancel its nanosleep.
+//
+void
+rq_remove(Runqueue *rq, Task *ts)
+{
+	if (ts->on_rq)
+	{
+		TASK_CLASS(ts)->dequeue(rq, ts);
+		ts->on_rq = 0;
+		rq->nr_queued--;
+	}
+	else if (ts->tw_slot)
+		tw_del(ts);
+	else if (ts->state == TASK_SLEEP)
+		hrtimer_cancel(&ts->sleep_timer);
+}
+
+// How a task handed to another CPU goes on there (see task_arrive)
+#define ARRIVE_RUNNABLE	0	// queued to run
+#define ARRIVE_WHEEL	1	// asleep until wake_at
+#define ARRIVE_HRTIMER	2	// in nanosleep until sleep_timer.expires
+#define ARRIVE_WAKEUP	3	// woken from a wait queue
+
+static void task_send(Task *ts, int how);
+
+// Queued tasks of 'rq', the ones a balancer can take
+#define RQ_LOAD(rq)	((rq)->nr_queued)
+
+//
+// Lock the runqueues of two CPUs, always the lower CPU first so that
+// two balancers going opposite ways can't deadlock.
+//
+static void
+rq_lock_two(Runqueue *a, Runqueue *b)
+{
+	if (a < b)
+	{
+		spin_lock(&a->lock);
+		spin_lock(&b->lock);
+	}
+	else
+	{
+		spin_lock(&b->lock);
+		spin_lock(&a->lock);
+	}
+}
+
+//
+// Pull runnable tasks from the busiest CPU to this one.  An idle CPU
+// takes a task as soon as anybody has one queued; a busy one only
+// evens out an imbalance of two or more, and leaves cache-hot tasks
+// where they are: unless 'idle', the class only offers tasks that ran
+// CACHE_HOT_TICKS or longer ago.  Tasks not allowed on this CPU stay
+// too.  Returns the number of tasks moved.
+//
+static int
+rq_balance(int idle)
+{
+	struct CpuInfo *c = thiscpu, *busiest = NULL;
+	Runqueue *rq = &c->cpu_rq, *src;
+	Task *ts;
+	int i, load, max = 0, n, moved = 0;
+
+	// The loads are read unlocked, they only have to be good hints
+	for (i = 0; i < ncpu; i++)
+	{
+		if (&cpus[i] == c || cpus[i].cpu_status != CPU_STARTED)
+			continue;
+		load = RQ_LOAD(&cpus[i].cpu_rq);
+		if (load > max)
+		{
+			max = load;
+			busiest = &cpus[i];
 		}
 	}
-	if(id == thiscpu->cpu_task->task_id)
-		thiscpu->cpu_task->remind_ticks = TIME_QUANT;
-	else if(thiscpu->cpu_task->state == TASK_RUNNING)
+	if (!busiest)
+		return 0;
+	n = idle ? 1 : (max - RQ_LOAD(rq)) / 2;
+	if (n <= 0)
+		return 0;
+
+	src = &busiest->cpu_rq;
+	rq_lock_two(rq, src);
+	while (moved < n && (ts = sched_class->pick_migratable(src, idle, c->cpu_id)))
+	{
+		rq_remove(src, ts);
+		ts->cpu_id = c->cpu_id;
+		rq_add(rq, ts, 0);
+		moved++;
+	}
+	c->cpu_stat[CPU_STAT_TASKS_STOLEN] += moved;
+	busiest->cpu_stat[CPU_STAT_TASKS_MIGRATED] += moved;
+	spin_unlock(&src->lock);
+	spin_unlock(&rq->lock);
+	return moved;
+}
+
+//
+// First thing on the kernel stack switch_to brought us to: the CPU is
+// done with the stack of the task before, so another CPU may run that
+// one now, or, if we killed it, the stack can go.
+//
+static void
+sched_finish(void)
+{
+	Task *prev = thiscpu->cpu_prev;
+
+	thiscpu->cpu_prev = NULL;
+	if (prev && prev == thiscpu->cpu_dead)
+	{
+		thiscpu->cpu_dead = NULL;
+		task_release(prev);
+	}
+	else if (prev)
+		prev->on_cpu = 0;
+}
+
+//
+// Pick the next task for this CPU and switch to it.  The current task
+// goes back to its class if it is still runnable; if it went to sleep
+// or was killed it is already off the runqueue.  A CPU about to
+// go idle first tries to steal work from the others.
+//
+// Returns once the current task is picked to run again, maybe on
+// another CPU; a killed one never comes back.
+//
+void sched_yield(void)
+{
+	Runqueue *rq = &thiscpu->cpu_rq;
+	Task *cur = thiscpu->cpu_task, *next, *handoff = NULL;
+
+	spin_lock(&rq->lock);
+	// charge the class for the time it ran, running on or not
+	if (cur && cur != rq->idle && cur->state != TASK_FREE)
+		TASK_CLASS(cur)->tick(rq, cur, 0);
+	if (cur && cur->state == TASK_RUNNING)
+	{
+		cur->state = TASK_RUNNABLE;
+		cur->last_ran = rq->clock;
+		if (cur != rq->idle)
+			rq_put_prev(rq, cur);
+		// migrate_call moved it to another CPU while it ran: hand it
+		// over once we are done with it
+		if (cur->cpu_id != thiscpu->cpu_id)
+		{
+			rq_remove(rq, cur);
+			handoff = cur;
+		}
+	}
+
+	if (RQ_LOAD(rq) == 0)
+	{
+		spin_unlock(&rq->lock);
+		rq_balance(1);
+		spin_lock(&rq->lock);
+	}
+	if ((next = sched_dl.pick_next(rq)) || (next = sched_class->pick_next(rq)))
+	{
+		next->on_rq = 0;
+		rq->nr_queued--;
+	}
+	else
+		next = rq->idle;
+	rq->need_resched = 0;
+
+	next->state = TASK_RUNNING;
+	thiscpu->cpu_task = next;
+	spin_unlock(&rq->lock);
+	timer_reprogram();
+	if (handoff)
+		task_send(handoff, ARRIVE_RUNNABLE);
+	if (next == cur)
+		return;
+
+	// the CPU it ran on last may not have left its kernel stack yet
+	while (next->on_cpu)
+	{
+		tlb_shootdown_poll();
+		asm volatile ("pause");
+	}
+	next->on_cpu = 1;
+	load_pgdir(next->pgdir);
+	thiscpu->cpu_tss.ts_esp0 = (uint32_t) next->kstack + TASK_KSTKSIZE;
+	thiscpu->cpu_prev = cur;
+	switch_to(&cur->kctx, next->kctx);
+	sched_finish();
+}
+
+//
+// Leave the boot stack for the first task of this CPU (see
+// task_init_percpu): the shell on the boot CPU, the idle task on the
+// others.  Nothing comes back to the boot stack.
+//
+void sched_start(void)
+{
+	Task *next = thiscpu->cpu_task;
+	struct Context *boot;
+
+	next->on_cpu = 1;
+	load_pgdir(next->pgdir);
+	thiscpu->cpu_tss.ts_esp0 = (uint32_t) next->kstack + TASK_KSTKSIZE;
+	thiscpu->cpu_prev = NULL;
+	switch_to(&boot, next->kctx);
+	panic("sched_start: back on the boot stack");
+}
+
+//
+// A new task starts here, on its own kernel stack, the first time it
+// is switched to (see task_alloc), and goes to user mode.
+//
+void task_start(void)
+{
+	sched_finish();
+	env_pop_tf(thiscpu->cpu_task->tf);
+}
+
+//
+// The idle loop: clear free pages for later ALLOC_ZERO requests, and
+// once there are enough, halt until an interrupt.  Interrupts are only
+// enabled across the hlt, and sti holds them off for one more
+// instruction, so the IPI of a cross-call bringing work (see
+// sched_wake) can't slip in between looking at the runqueue and
+// halting.
+//
+static void
+idle_loop(void)
+{
+	Runqueue *rq = &thiscpu->cpu_rq;
+
+	for (;;)
 	{
-		thiscpu->cpu_task->state = TASK_RUNNABLE;
-		thiscpu->cpu_task->remind_ticks = TIME_QUANT;
-		thiscpu->cpu_task = &(tasks[id]);
-		thiscpu->cpu_task->state = TASK_RUNNING;
-	    lcr3(PADDR(thiscpu->cpu_task->pgdir));
-		ctx_switch(&tasks[id]);
+		if (RQ_LOAD(rq) > 0)
+			sched_yield();
+		if (page_prezero() == 0)
+			__asm __volatile("sti; hlt; cli");
 	}
+}
+
+//
+// The idle task of a CPU starts here (see task_init_percpu), and never
+// leaves the kernel.
+//
+void sched_idle(void)
+{
+	sched_finish();
+	idle_loop();
+	panic("idle loop returned");
+}
+
+//
+// Runs on the CPU task 'pid' was handed to (see task_send): queue it
+// here, or put it back to sleep here until the same time.  It was on
+// no queue on the way, so all we have to check is that it wasn't
+// killed in the meantime.
+//
+static void
+task_arrive(uint32_t pid, uint32_t how)
+{
+	Runqueue *rq = &thiscpu->cpu_rq;
+	Task *ts = &tasks[pid];
+
+	spin_lock(&rq->lock);
+	if (ts->cpu_id == thiscpu->cpu_id && !ts->on_rq && !ts->tw_slot)
+	{
+		// a sleeper migrate_call moved comes with a relative vruntime
+		if (how == ARRIVE_WHEEL || how == ARRIVE_HRTIMER)
+			ts->vruntime += rq->min_vruntime;
+		if (how == ARRIVE_RUNNABLE && ts->state == TASK_RUNNABLE)
+			rq_add(rq, ts, 0);
+		else if (how == ARRIVE_WHEEL && ts->state == TASK_SLEEP &&
+			 (int32_t) (ts->wake_at - rq->clock) > 0)
+			tw_add(rq, ts);
+		else if (how == ARRIVE_WHEEL && ts->state == TASK_SLEEP)
+		{
+			ts->state = TASK_RUNNABLE;
+			rq_add(rq, ts, 1);
+		}
+		else if (how == ARRIVE_HRTIMER && ts->state == TASK_SLEEP)
+			hrtimer_start(&ts->sleep_timer, ts->sleep_timer.expires);
+		else if (how == ARRIVE_WAKEUP && ts->state == TASK_SLEEP)
+		{
+			ts->state = TASK_RUNNABLE;
+			rq_add(rq, ts, 1);
+		}
+	}
+	spin_unlock(&rq->lock);
+	if (how == ARRIVE_HRTIMER)
+		timer_reprogram();
+}
+
+//
+// Hand 'ts', which is on no queue, to CPU ts->cpu_id.  Every task has
+// only one handover under way at a time, so it carries its own xcall
+// for it and this can't fail.
+//
+static void
+task_send(Task *ts, int how)
+{
+	ts->arrive.xc_fn = task_arrive;
+	ts->arrive.xc_a1 = ts->task_id;
+	ts->arrive.xc_a2 = how;
+	ts->arrive.xc_kmalloc = 0;
+	xcall_send(ts->cpu_id, &ts->arrive);
+}
+
+//
+// Queue the new runnable task 'ts' on CPU ts->cpu_id.  The cross-call
+// also wakes that CPU at once if it is halted in its idle loop, rather
+// than leave the task until its next timer interrupt.
+//
+void sched_wake(Task *ts)
+{
+	if (ts->cpu_id != thiscpu->cpu_id)
+		task_send(ts, ARRIVE_RUNNABLE);
+	else
+		task_arrive(ts->task_id, ARRIVE_RUNNABLE);
+}
+
+//
+// Wake 'ts', which wq_wake just took off a wait queue, on its CPU.  A
+// task asleep on a wait queue stays on its CPU (see migrate_call), and
+// its CPU gets the cross-call only once it has switched away from it.
+//
+void sched_wakeup(Task *ts)
+{
+	if (ts->cpu_id != thiscpu->cpu_id)
+		task_send(ts, ARRIVE_WAKEUP);
 	else
+		task_arrive(ts->task_id, ARRIVE_WAKEUP);
+}
+
+//
+// Move task 'pid' to CPU 'cpu'.  Only the CPU the task is on can take
+// it off its queues, so this runs there, and follows the task if the
+// balancer moved it first.  A running task is handed over by
+// sched_yield, which xcall_handler calls once we return.
+//
+static void
+migrate_call(uint32_t pid, uint32_t cpu)
+{
+	Runqueue *rq = &thiscpu->cpu_rq;
+	Task *ts = &tasks[pid];
+	int how;
+
+	spin_lock(&rq->lock);
+	if (ts->cpu_id != thiscpu->cpu_id)
 	{
-		thiscpu->cpu_task = &(tasks[id]);
-		thiscpu->cpu_task->state = TASK_RUNNING;
-	    lcr3(PADDR(thiscpu->cpu_task->pgdir));
-		ctx_switch(&tasks[id]);
+		spin_unlock(&rq->lock);
+		if (ts->state != TASK_FREE)
+			xcall_post(ts->cpu_id, migrate_call, pid, cpu);
+		return;
 	}
-}
\ No newline at end of file
+	if (ts->state == TASK_FREE || ts == rq->idle || cpu == ts->cpu_id ||
+	    ts->dl_runtime || !TASK_ALLOWED(ts, cpu))
+	{
+		spin_unlock(&rq->lock);
+		return;
+	}
+
+	how = -1;
+	if (ts->on_rq)
+	{
+		rq_remove(rq, ts);
+		how = ARRIVE_RUNNABLE;
+	}
+	else if (ts->tw_slot)
+	{
+		tw_del(ts);
+		how = ARRIVE_WHEEL;
+	}
+	else if (ts->state == TASK_SLEEP && hrtimer_cancel(&ts->sleep_timer))
+		how = ARRIVE_HRTIMER;
+	else if (ts->state != TASK_RUNNING)
+	{
+		// still on its way here, or its nanosleep is waking it
+		// up right now: leave it be
+		spin_unlock(&rq->lock);
+		return;
+	}
+	// a sleeper left the CFS tree with its vruntime as it was here;
+	// take it over relative to our min_vruntime, like rq_remove does
+	// for queued ones, and task_arrive bases it on the new CPU's
+	if (how == ARRIVE_WHEEL || how == ARRIVE_HRTIMER)
+		ts->vruntime -= rq->min_vruntime;
+	ts->cpu_id = cpu;
+	spin_unlock(&rq->lock);
+	if (how >= 0)
+		task_send(ts, how);
+}
+
+//
+// Timer interrupt on this CPU.  The LAPIC timer doesn't interrupt on
+// every tick (see sched_idle_ticks) and also fires for hrtimers in
+// between, so bring rq->clock up to timer_ticks() and wake the
+// sleepers whose time is up on the way.  Then balance the load (on
+// every interrupt while idle, every BALANCE_TICKS otherwise), and
+// preempt the current task when its class says so or a woken task
+// should run first, or right away if it is the idle task and there is
+// something else to run.
+//
+void sched_tick(void)
+{
+	Runqueue *rq = &thiscpu->cpu_rq;
+	Task *cur = thiscpu->cpu_task;
+	uint32_t now = timer_ticks(), elapsed;
+	int balance;
+
+	spin_lock(&rq->lock);
+	elapsed = now - rq->clock;
+	balance = elapsed && rq->clock / BALANCE_TICKS != now / BALANCE_TICKS;
+	while (rq->clock != now)
+	{
+		rq->clock++;
+		tw_run(rq);
+	}
+	if (cur != rq->idle && TASK_CLASS(cur)->tick(rq, cur, elapsed))
+		rq->need_resched = 1;
+	spin_unlock(&rq->lock);
+
+	if (cur == rq->idle ? RQ_LOAD(rq) == 0 : balance)
+		rq_balance(cur == rq->idle);
+
+	if (cur == rq->idle ? RQ_LOAD(rq) > 0 : rq->need_resched)
+		sched_yield();
+}
+
+//
+// How many ticks this CPU can go before its next timer interrupt.  A
+// busy CPU needs every tick for time slices; an idle one only needs
+// to wake up for the next timer wheel slot with sleepers in it, or
+// when level 0 wraps around and the higher levels cascade into it.
+// It still looks for queued or stealable work every NOHZ_IDLE_TICKS.
+//
+uint32_t sched_idle_ticks(void)
+{
+	Runqueue *rq = &thiscpu->cpu_rq;
+	uint32_t n, t;
+
+	if (thiscpu->cpu_task != rq->idle)
+		return 1;
+	spin_lock(&rq->lock);
+	for (n = 1; n < NOHZ_IDLE_TICKS && RQ_LOAD(rq) == 0; n++)
+	{
+		t = (rq->clock + n) & (TW_SIZE - 1);
+		if (t == 0 || rq->wheel.slot[0][t])
+			break;
+	}
+	spin_unlock(&rq->lock);
+	return n;
+}
+
+//
+// Put the current task to sleep for 'ticks' timer ticks.
+//
+void sched_sleep(uint32_t ticks)
+{
+	Runqueue *rq = &thiscpu->cpu_rq;
+	Task *cur = thiscpu->cpu_task;
+
+	spin_lock(&rq->lock);
+	cur->wake_at = rq->clock + (ticks ? ticks : 1);
+	cur->state = TASK_SLEEP;
+	tw_add(rq, cur);
+	spin_unlock(&rq->lock);
+	sched_yield();
+}
+
+//
+// sleep_timer of a task in nanosleep went off: make it runnable again,
+// unless it was killed in the meantime.
+//
+static void
+nanosleep_wake(struct hrtimer *t)
+{
+	Task *ts = (Task *) ((char *) t - offsetof(Task, sleep_timer));
+	Runqueue *rq = task_rq_lock(ts);
+
+	if (ts->state == TASK_SLEEP && !ts->tw_slot)
+	{
+		ts->state = TASK_RUNNABLE;
+		rq_add(rq, ts, 1);
+	}
+	spin_unlock(&rq->lock);
+}
+
+/* This is the system call implementation of nanosleep */
+/* Sleep for 'sec' seconds and 'nsec' nanoseconds, to the next
+ * microsecond; 0 once that has passed, -1 if nsec is out of range */
+int sys_nanosleep(uint32_t sec, uint32_t nsec)
+{
+	Task *cur = thiscpu->cpu_task;
+	uint64_t us;
+
+	if (nsec >= 1000000000)
+		return -1;
+	us = (uint64_t) sec * 1000000 + (nsec + 999) / 1000;
+
+	cur->sleep_timer.fn = nanosleep_wake;
+	cur->state = TASK_SLEEP;
+	// sched_yield sets the LAPIC timer for it
+	hrtimer_start(&cur->sleep_timer, timer_now_us() + us);
+	sched_yield();
+	return 0;
+}
+
+//
+// Lock the runqueue 'ts' is on.  Its CPU can change until we hold the
+// lock, so check again afterwards.
+//
+Runqueue *
+task_rq_lock(Task *ts)
+{
+	Runqueue *rq;
+
+	for (;;)
+	{
+		rq = &cpus[ts->cpu_id].cpu_rq;
+		spin_lock(&rq->lock);
+		if (rq == &cpus[ts->cpu_id].cpu_rq)
+			return rq;
+		spin_unlock(&rq->lock);
+	}
+}
+
+/* This is the system call implementation of setpriority */
+/* Set the nice value of task 'pid'; 0 on success, -1 on a bad pid or
+ * a nice value out of range */
+int sys_setpriority(int pid, int nice)
+{
+	Task *ts;
+	Runqueue *rq;
+	int queued;
+
+	if (pid < 0 || pid >= NR_TASKS || nice < NICE_MIN || nice > NICE_MAX)
+		return -1;
+	ts = &tasks[pid];
+
+	rq = task_rq_lock(ts);
+	if (ts->state == TASK_FREE)
+	{
+		spin_unlock(&rq->lock);
+		return -1;
+	}
+	// a queued task is queued again for its new priority
+	if ((queued = ts->on_rq))
+		rq_remove(rq, ts);
+	ts->nice = nice;
+	if (queued)
+		rq_add(rq, ts, 0);
+	spin_unlock(&rq->lock);
+	return 0;
+}
+
+/* This is the system call implementation of nice */
+/* Add 'inc' to the nice value of the current task, within range, and
+ * return the new value */
+int sys_nice(int inc)
+{
+	int nice = thiscpu->cpu_task->nice + inc;
+
+	if (nice < NICE_MIN)
+		nice = NICE_MIN;
+	if (nice > NICE_MAX)
+		nice = NICE_MAX;
+	sys_setpriority(thiscpu->cpu_task->task_id, nice);
+	return nice;
+}
+
+/* This is the system call implementation of migrate */
+/* Move task 'pid' to CPU 'cpu'; 0 if the move is under way, -1 on a
+ * bad pid or CPU, a CPU outside the task's affinity, or an EDF task */
+int sys_migrate(int pid, int cpu)
+{
+	Task *ts, *cur = thiscpu->cpu_task;
+
+	if (pid < 0 || pid >= NR_TASKS || cpu < 0 || cpu >= ncpu ||
+	    cpus[cpu].cpu_status != CPU_STARTED)
+		return -1;
+	ts = &tasks[pid];
+	// EDF tasks stay on the CPU that admitted their bandwidth
+	if (ts->state == TASK_FREE || ts == cpus[ts->cpu_id].cpu_rq.idle ||
+	    ts->dl_runtime || !TASK_ALLOWED(ts, cpu))
+		return -1;
+
+	if (ts->cpu_id != thiscpu->cpu_id)
+		return xcall_post(ts->cpu_id, migrate_call, pid, cpu);
+	migrate_call(pid, cpu);
+	if (cur->cpu_id != thiscpu->cpu_id)
+	{
+		// we moved ourselves: go on over there
+		sched_yield();
+	}
+	return 0;
+}
+
+/* This is the system call implementation of sched_setaffinity */
+/* Let task 'pid' run only on the CPUs in 'mask' (bit i for CPU i), and
+ * move it to the first of them if its CPU isn't one.  -1 on a bad pid,
+ * a mask with no running CPU, or an EDF task that would have to move */
+int sys_sched_setaffinity(int pid, uint32_t mask)
+{
+	Task *ts;
+	Runqueue *rq;
+	int i, cpu;
+
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_status != CPU_STARTED)
+			mask &= ~(1 << i);
+	mask &= (1 << ncpu) - 1;
+	if (pid < 0 || pid >= NR_TASKS || mask == 0)
+		return -1;
+	ts = &tasks[pid];
+
+	rq = task_rq_lock(ts);
+	if (ts->state == TASK_FREE || ts == rq->idle ||
+	    (ts->dl_runtime && !(mask & (1 << ts->cpu_id))))
+	{
+		spin_unlock(&rq->lock);
+		return -1;
+	}
+	ts->cpus_allowed = mask;
+	cpu = ts->cpu_id;
+	spin_unlock(&rq->lock);
+
+	if (TASK_ALLOWED(ts, cpu))
+		return 0;
+	for (cpu = 0; !TASK_ALLOWED(ts, cpu); cpu++)
+		;
+	return sys_migrate(pid, cpu);
+}
+
+/* This is the system call implementation of sched_getaffinity */
+/* The CPUs task 'pid' may run on, as a mask; -1 on a bad pid */
+int sys_sched_getaffinity(int pid)
+{
+	if (pid < 0 || pid >= NR_TASKS || tasks[pid].state == TASK_FREE)
+		return -1;
+	return tasks[pid].cpus_allowed;
+}
@@ -0,0 +1,309 @@
+/* The completely fair scheduling class */
+#include <kernel/task.h>
+#include <kernel/timer.h>
+
+// CFS runs, of the tasks queued on a CPU, the one that has had the
+// least virtual runtime: time on the CPU scaled by NICE_0_WEIGHT over
+// the task's weight, so a task of nice -5 gets about three times the
+// CPU of one of nice 0.  Within every CFS_LATENCY_US each queued task
+// gets a slice in proportion to its weight, and a task that wakes up
+// having run less than the current one preempts it.  The queued tasks
+// are kept in an AVL tree keyed by vruntime; the running one is not in
+// it.
+#define CFS_LATENCY_US		(6 * TICK_US)	// period in which every task runs
+#define CFS_MIN_GRAN_US		TICK_US		// shortest slice
+#define CFS_WAKEUP_GRAN_US	(TICK_US / 2)	// lead a woken task needs to preempt
+#define NICE_0_WEIGHT		1024
+
+// Each step of nice is worth about 10% of CPU against a task one step
+// away, which takes a factor of about 1.25 in weight.
+static const uint32_t cfs_weights[NR_PRIO] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */  9548,  7620,  6100,  4904,  3906,
+	/*  -5 */  3121,  2501,  1991,  1586,  1277,
+	/*   0 */  1024,   820,   655,   526,   423,
+	/*   5 */   335,   272,   215,   172,   137,
+	/*  10 */   110,    87,    70,    56,    45,
+	/*  15 */    36,    29,    23,    18,    15,
+};
+
+#define CFS_WEIGHT(ts)	(cfs_weights[NICE_TO_PRIO((ts)->nice)])
+
+// Tree order: by vruntime, ties broken by pid so every key is unique
+#define CFS_BEFORE(a, b)	((a)->vruntime < (b)->vruntime || \
+				 ((a)->vruntime == (b)->vruntime && (a)->task_id < (b)->task_id))
+
+// --------------------------------------------------------------
+// The AVL tree.  It holds at most NR_TASKS tasks, so recursion is
+// only a few levels deep.
+// --------------------------------------------------------------
+
+static int
+avl_height(Task *n)
+{
+	return n ? n->cfs_height : 0;
+}
+
+static void
+avl_fix_height(Task *n)
+{
+	int l = avl_height(n->cfs_left), r = avl_height(n->cfs_right);
+
+	n->cfs_height = (l > r ? l : r) + 1;
+}
+
+static Task *
+avl_rotate_right(Task *n)
+{
+	Task *l = n->cfs_left;
+
+	n->cfs_left = l->cfs_right;
+	l->cfs_right = n;
+	avl_fix_height(n);
+	avl_fix_height(l);
+	return l;
+}
+
+static Task *
+avl_rotate_left(Task *n)
+{
+	Task *r = n->cfs_right;
+
+	n->cfs_right = r->cfs_left;
+	r->cfs_left = n;
+	avl_fix_height(n);
+	avl_fix_height(r);
+	return r;
+}
+
+// Restore the AVL property at 'n', whose subtrees are AVL trees that
+// differ in height by at most 2; returns the new root of the subtree.
+static Task *
+avl_balance(Task *n)
+{
+	int bf = avl_height(n->cfs_left) - avl_height(n->cfs_right);
+
+	avl_fix_height(n);
+	if (bf > 1)
+	{
+		if (avl_height(n->cfs_left->cfs_left) < avl_height(n->cfs_left->cfs_right))
+			n->cfs_left = avl_rotate_left(n->cfs_left);
+		return avl_rotate_right(n);
+	}
+	if (bf < -1)
+	{
+		if (avl_height(n->cfs_right->cfs_right) < avl_height(n->cfs_right->cfs_left))
+			n->cfs_right = avl_rotate_right(n->cfs_right);
+		return avl_rotate_left(n);
+	}
+	return n;
+}
+
+static Task *
+avl_insert(Task *root, Task *ts)
+{
+	if (!root)
+	{
+		ts->cfs_left = ts->cfs_right = NULL;
+		ts->cfs_height = 1;
+		return ts;
+	}
+	if (CFS_BEFORE(ts, root))
+		root->cfs_left = avl_insert(root->cfs_left, ts);
+	else
+		root->cfs_right = avl_insert(root->cfs_right, ts);
+	return avl_balance(root);
+}
+
+// Unlink the leftmost task of 'root' into *min
+static Task *
+avl_remove_min(Task *root, Task **min)
+{
+	if (!root->cfs_left)
+	{
+		*min = root;
+		return root->cfs_right;
+	}
+	root->cfs_left = avl_remove_min(root->cfs_left, min);
+	return avl_balance(root);
+}
+
+static Task *
+avl_remove(Task *root, Task *ts)
+{
+	Task *succ, *right;
+
+	if (root == ts)
+	{
+		if (!ts->cfs_right)
+			return ts->cfs_left;
+		right = avl_remove_min(ts->cfs_right, &succ);
+		succ->cfs_left = ts->cfs_left;
+		succ->cfs_right = right;
+		return avl_balance(succ);
+	}
+	if (CFS_BEFORE(ts, root))
+		root->cfs_left = avl_remove(root->cfs_left, ts);
+	else
+		root->cfs_right = avl_remove(root->cfs_right, ts);
+	return avl_balance(root);
+}
+
+static Task *
+avl_first(Task *root)
+{
+	if (root)
+		while (root->cfs_left)
+			root = root->cfs_left;
+	return root;
+}
+
+// --------------------------------------------------------------
+// The class.
+// --------------------------------------------------------------
+
+static void
+cfs_init(Runqueue *rq)
+{
+	rq->cfs_root = NULL;
+	rq->cfs_load = 0;
+	rq->min_vruntime = 0;
+}
+
+// min_vruntime follows the least vruntime of the running task 'cur'
+// and the queued ones, but never goes backwards
+static void
+cfs_update_min(Runqueue *rq, Task *cur)
+{
+	Task *first = avl_first(rq->cfs_root);
+	uint64_t v;
+
+	if (cur && (!first || cur->vruntime < first->vruntime))
+		v = cur->vruntime;
+	else if (first)
+		v = first->vruntime;
+	else
+		return;
+	if (v > rq->min_vruntime)
+		rq->min_vruntime = v;
+}
+
+// Charge 'cur' for the time it ran since it was last charged
+static void
+cfs_update_curr(Runqueue *rq, Task *cur)
+{
+	uint64_t now = timer_now_us();
+	uint32_t delta = now - cur->exec_start;
+
+	cur->exec_start = now;
+	cur->slice_used += delta;
+	cur->vruntime += (uint64_t) delta * NICE_0_WEIGHT / CFS_WEIGHT(cur);
+	cfs_update_min(rq, cur);
+}
+
+//
+// Off a runqueue, a task's vruntime is kept relative to that queue's
+// min_vruntime (see cfs_dequeue), so it keeps its place when it moves
+// to another CPU.  A task that slept gets at most half a period of
+// credit for it, or it would hog the CPU to make up for all that time.
+//
+static int
+cfs_enqueue(Runqueue *rq, Task *ts, int wakeup)
+{
+	if (!wakeup)
+		ts->vruntime += rq->min_vruntime;
+	else if (ts->vruntime + CFS_LATENCY_US / 2 < rq->min_vruntime)
+		ts->vruntime = rq->min_vruntime - CFS_LATENCY_US / 2;
+	rq->cfs_root = avl_insert(rq->cfs_root, ts);
+	rq->cfs_load += CFS_WEIGHT(ts);
+	return 1;
+}
+
+static void
+cfs_dequeue(Runqueue *rq, Task *ts)
+{
+	rq->cfs_root = avl_remove(rq->cfs_root, ts);
+	rq->cfs_load -= CFS_WEIGHT(ts);
+	ts->vruntime -= rq->min_vruntime;
+}
+
+// sched_yield has charged 'ts' already
+static int
+cfs_put_prev(Runqueue *rq, Task *ts)
+{
+	rq->cfs_root = avl_insert(rq->cfs_root, ts);
+	rq->cfs_load += CFS_WEIGHT(ts);
+	return 1;
+}
+
+static Task *
+cfs_pick_next(Runqueue *rq)
+{
+	Task *ts = avl_first(rq->cfs_root);
+
+	if (!ts)
+		return NULL;
+	rq->cfs_root = avl_remove(rq->cfs_root, ts);
+	rq->cfs_load -= CFS_WEIGHT(ts);
+	ts->exec_start = timer_now_us();
+	ts->slice_used = 0;
+	cfs_update_min(rq, ts);
+	return ts;
+}
+
+// Preempt 'cur' once it has used up its share of the period
+static int
+cfs_tick(Runqueue *rq, Task *cur, uint32_t ticks)
+{
+	uint32_t w = CFS_WEIGHT(cur), slice;
+
+	cfs_update_curr(rq, cur);
+	if (!rq->cfs_root)
+		return 0;
+	slice = (uint64_t) CFS_LATENCY_US * w / (rq->cfs_load + w);
+	if (slice < CFS_MIN_GRAN_US)
+		slice = CFS_MIN_GRAN_US;
+	return cur->slice_used >= slice;
+}
+
+static int
+cfs_preempt(Runqueue *rq, Task *cur, Task *ts)
+{
+	cfs_update_curr(rq, cur);
+	return ts->vruntime + CFS_WAKEUP_GRAN_US < cur->vruntime;
+}
+
+// The task with the most vruntime, which would run last, that isn't
+// cache-hot unless 'hot_ok' and may run on 'cpu'
+static Task *
+cfs_find_migratable(Runqueue *rq, Task *n, int hot_ok, int cpu)
+{
+	Task *ts;
+
+	if (!n)
+		return NULL;
+	if ((ts = cfs_find_migratable(rq, n->cfs_right, hot_ok, cpu)))
+		return ts;
+	if ((hot_ok || !TASK_CACHE_HOT(rq, n)) && TASK_ALLOWED(n, cpu))
+		return n;
+	return cfs_find_migratable(rq, n->cfs_left, hot_ok, cpu);
+}
+
+static Task *
+cfs_pick_migratable(Runqueue *rq, int hot_ok, int cpu)
+{
+	return cfs_find_migratable(rq, rq->cfs_root, hot_ok, cpu);
+}
+
+struct SchedClass sched_cfs = {
+	.name = "cfs",
+	.init = cfs_init,
+	.enqueue = cfs_enqueue,
+	.dequeue = cfs_dequeue,
+	.put_prev = cfs_put_prev,
+	.pick_next = cfs_pick_next,
+	.tick = cfs_tick,
+	.preempt = cfs_preempt,
+	.pick_migratable = cfs_pick_migratable,
+};
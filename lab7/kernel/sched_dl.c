@@ -0,0 +1,276 @@
+/* The earliest-deadline-first real-time scheduling class */
+#include <inc/string.h>
+#include <kernel/task.h>
+#include <kernel/cpu.h>
+#include <kernel/timer.h>
+
+// A task declares with sched_setdeadline that it needs 'runtime' us of
+// CPU every 'period' us, done within 'deadline' us of the period's
+// start.  From then on it runs before every task of the normal class,
+// and of the EDF tasks on a CPU the one whose current job is due first
+// runs.  A CPU only admits tasks while their runtime / period adds up
+// to at most DL_BW_MAX, which is what makes the deadlines possible to
+// keep, and never lets a task run over its runtime: one that used it
+// up is throttled, off the runqueue until its next period starts, so
+// it can't starve the others.  EDF tasks stay on the CPU that admitted
+// them.
+//
+// A task that wakes up keeps what is left of its runtime only if
+// using it by the deadline doesn't go over its bandwidth (the constant
+// bandwidth server rule); otherwise it starts a new job at once.
+#define DL_BW_SHIFT	20
+#define DL_BW(r, p)	((uint32_t) (((uint64_t) (r) << DL_BW_SHIFT) / (p)))
+#define DL_BW_MAX	(DL_BW(95, 100))	// leave the normal class some CPU
+
+// Start a new job of 'ts' at 'start'
+static void
+dl_replenish(Task *ts, uint64_t start)
+{
+	ts->dl_remaining = ts->dl_runtime;
+	ts->dl_abs_deadline = start + ts->dl_deadline;
+	ts->dl_missed = 0;
+}
+
+// A job that is still not done when due counts once as a miss
+static void
+dl_check_miss(Task *ts, uint64_t now)
+{
+	if (!ts->dl_missed && ts->dl_remaining > 0 && now > ts->dl_abs_deadline)
+	{
+		ts->dl_missed = 1;
+		thiscpu->cpu_stat[CPU_STAT_DL_MISSES]++;
+	}
+}
+
+// 'ts' is out of runtime: hold it back until its next period starts
+static void
+dl_throttle(Task *ts)
+{
+	ts->dl_throttled = 1;
+	hrtimer_cancel(&ts->dl_timer);
+	hrtimer_start(&ts->dl_timer,
+	    ts->dl_abs_deadline - ts->dl_deadline + ts->dl_period);
+}
+
+//
+// dl_timer either ends the runtime of the running task, which the
+// timer interrupt's sched_tick takes care of, or ends the throttling
+// of a task at the start of its next period.  A task queued again then
+// may be due before the running one, so sched_tick picks again.
+//
+static void
+dl_timer_fn(struct hrtimer *t)
+{
+	Task *ts = (Task *) ((char *) t - offsetof(Task, dl_timer));
+	Runqueue *rq = task_rq_lock(ts);
+
+	if (ts->dl_runtime && ts->dl_throttled)
+	{
+		ts->dl_throttled = 0;
+		dl_replenish(ts, t->expires);
+		if (ts->state == TASK_RUNNABLE && !ts->on_rq)
+		{
+			rq_add(rq, ts, 0);
+			rq->need_resched = 1;
+		}
+	}
+	spin_unlock(&rq->lock);
+}
+
+static void
+dl_init(Runqueue *rq)
+{
+	rq->dl_head = NULL;
+	rq->dl_bw = 0;
+}
+
+// Queue 'ts' in deadline order
+static void
+dl_insert(Runqueue *rq, Task *ts)
+{
+	Task **p = &rq->dl_head, *prev = NULL;
+
+	while (*p && (*p)->dl_abs_deadline <= ts->dl_abs_deadline)
+	{
+		prev = *p;
+		p = &(*p)->rq_next;
+	}
+	ts->rq_next = *p;
+	ts->rq_prev = prev;
+	if (*p)
+		(*p)->rq_prev = ts;
+	*p = ts;
+}
+
+static int
+dl_enqueue(Runqueue *rq, Task *ts, int wakeup)
+{
+	uint64_t now = timer_now_us();
+
+	if (ts->dl_throttled)
+		return 0;
+	if (wakeup)
+	{
+		if (ts->dl_remaining <= 0 && now < ts->dl_abs_deadline)
+		{
+			dl_throttle(ts);
+			return 0;
+		}
+		if (now >= ts->dl_abs_deadline ||
+		    (uint64_t) ts->dl_remaining * ts->dl_period >
+		    (ts->dl_abs_deadline - now) * ts->dl_runtime)
+			dl_replenish(ts, now);
+	}
+	dl_insert(rq, ts);
+	return 1;
+}
+
+static void
+dl_dequeue(Runqueue *rq, Task *ts)
+{
+	if (ts->rq_prev)
+		ts->rq_prev->rq_next = ts->rq_next;
+	else
+		rq->dl_head = ts->rq_next;
+	if (ts->rq_next)
+		ts->rq_next->rq_prev = ts->rq_prev;
+	ts->rq_next = ts->rq_prev = NULL;
+}
+
+// sched_yield has charged 'ts' already, and maybe throttled it
+static int
+dl_put_prev(Runqueue *rq, Task *ts)
+{
+	if (ts->dl_throttled)
+		return 0;
+	dl_insert(rq, ts);
+	return 1;
+}
+
+//
+// Run the task due first, and set dl_timer to take the CPU back when
+// its runtime is up.  sched_yield programs the LAPIC timer for it.
+//
+static Task *
+dl_pick_next(Runqueue *rq)
+{
+	Task *ts = rq->dl_head;
+
+	if (!ts)
+		return NULL;
+	dl_dequeue(rq, ts);
+	ts->exec_start = timer_now_us();
+	dl_check_miss(ts, ts->exec_start);
+	hrtimer_cancel(&ts->dl_timer);
+	hrtimer_start(&ts->dl_timer, ts->exec_start + ts->dl_remaining);
+	return ts;
+}
+
+// Charge 'cur' for the time it ran; preempt it once its runtime is up
+static int
+dl_tick(Runqueue *rq, Task *cur, uint32_t ticks)
+{
+	uint64_t now = timer_now_us();
+
+	if (cur->dl_throttled)
+		return 1;
+	cur->dl_remaining -= (uint32_t) (now - cur->exec_start);
+	cur->exec_start = now;
+	dl_check_miss(cur, now);
+	if (cur->dl_remaining > 0)
+		return 0;
+	dl_throttle(cur);
+	return 1;
+}
+
+static int
+dl_preempt(Runqueue *rq, Task *cur, Task *ts)
+{
+	return ts->dl_abs_deadline < cur->dl_abs_deadline;
+}
+
+// EDF tasks stay where they were admitted
+static Task *
+dl_pick_migratable(Runqueue *rq, int hot_ok, int cpu)
+{
+	return NULL;
+}
+
+struct SchedClass sched_dl = {
+	.name = "edf",
+	.init = dl_init,
+	.enqueue = dl_enqueue,
+	.dequeue = dl_dequeue,
+	.put_prev = dl_put_prev,
+	.pick_next = dl_pick_next,
+	.tick = dl_tick,
+	.preempt = dl_preempt,
+	.pick_migratable = dl_pick_migratable,
+};
+
+//
+// 'ts' leaves the EDF class, or is killed: give its bandwidth back.
+// Caller holds rq->lock, and 'ts' is on no queue.
+//
+void
+sched_dl_exit(Runqueue *rq, Task *ts)
+{
+	if (!ts->dl_runtime)
+		return;
+	hrtimer_cancel(&ts->dl_timer);
+	rq->dl_bw -= ts->dl_bw;
+	ts->dl_runtime = ts->dl_bw = 0;
+	ts->dl_throttled = 0;
+}
+
+/* This is the system call implementation of sched_setdeadline */
+/* Make the current task an EDF task that needs 'runtime' us of CPU
+ * every 'period' us within 'deadline' us (0: the period) of its start,
+ * or a normal task again if runtime is 0.  -1 if the values make no
+ * sense or this CPU can't take the bandwidth. */
+int sys_sched_setdeadline(uint32_t runtime, uint32_t period, uint32_t deadline)
+{
+	Task *cur = thiscpu->cpu_task;
+	Runqueue *rq = &thiscpu->cpu_rq;
+	uint32_t bw = 0;
+
+	if (deadline == 0)
+		deadline = period;
+	if (runtime && (runtime > deadline || deadline > period))
+		return -1;
+	if (runtime)
+		bw = DL_BW(runtime, period);
+
+	spin_lock(&rq->lock);
+	if (rq->dl_bw - cur->dl_bw + bw > DL_BW_MAX)
+	{
+		spin_unlock(&rq->lock);
+		return -1;
+	}
+	// charge the time run so far to the class it ran in
+	TASK_CLASS(cur)->tick(rq, cur, 0);
+	if (!runtime)
+	{
+		if (cur->dl_runtime)
+			cur->vruntime = rq->min_vruntime;
+		sched_dl_exit(rq, cur);
+	}
+	else
+	{
+		hrtimer_cancel(&cur->dl_timer);
+		rq->dl_bw += bw - cur->dl_bw;
+		cur->dl_runtime = runtime;
+		cur->dl_period = period;
+		cur->dl_deadline = deadline;
+		cur->dl_bw = bw;
+		cur->dl_throttled = 0;
+		cur->dl_timer.fn = dl_timer_fn;
+		cur->exec_start = timer_now_us();
+		dl_replenish(cur, cur->exec_start);
+	}
+	spin_unlock(&rq->lock);
+
+	// pick again under the new class
+	sched_yield();
+	return 0;
+}
@@ -5,44 +5,67 @@
 #include <inc/x86.h>
 #include <inc/memlayout.h>
 #include <inc/string.h>
+#include <inc/syscall.h>
 #include <kernel/cpu.h>
 #include <kernel/spinlock.h>
+#include <kernel/mem.h>
 
 #ifdef DEBUG_SPINLOCK
-// Record the current call stack in pcs[] by following the %ebp chain.
+// Check whether this CPU is holding the lock.
+static int
+holding(struct spinlock *lock)
+{
+	return lock->owner != lock->next && lock->cpu == thiscpu;
+}
+#endif
+
+#ifdef LOCK_STAT
+// Every lock that is counted.  Locks are set up one CPU at a time
+// during boot, so this needs no lock of its own.
+static struct spinlock *lock_stat_locks[LOCK_STAT_MAX];
+static int nlock_stat;
+
 static void
-get_caller_pcs(uint32_t pcs[])
+lock_stat_add(struct spinlock *lk)
 {
-	uint32_t *ebp;
 	int i;
 
-	ebp = (uint32_t *)read_ebp();
-	for (i = 0; i < 10; i++){
-		if (ebp == 0 || ebp < (uint32_t *)ULIM)
-			break;
-		pcs[i] = ebp[1];          // saved %eip
-		ebp = (uint32_t *)ebp[0]; // saved %ebp
-	}
-	for (; i < 10; i++)
-		pcs[i] = 0;
+	lk->acquires = lk->contended = 0;
+	lk->spin_cycles = 0;
+	for (i = 0; i < nlock_stat; i++)
+		if (lock_stat_locks[i] == lk)
+			return;
+	if (nlock_stat < LOCK_STAT_MAX)
+		lock_stat_locks[nlock_stat++] = lk;
 }
 
-// Check whether this CPU is holding the lock.
+// Locks with one name, like the runqueue locks of all CPUs, count as
+// one.  Is lock_stat_locks[i] the first of its name?
 static int
-holding(struct spinlock *lock)
+lock_stat_first(int i)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	int j;
+
+	for (j = 0; j < i; j++)
+		if (strcmp(lock_stat_locks[j]->name, lock_stat_locks[i]->name) == 0)
+			return 0;
+	return 1;
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	lk->next = lk->owner = 0;
+#if defined(DEBUG_SPINLOCK) || defined(LOCK_STAT)
 	lk->name = name;
+#endif
+#ifdef DEBUG_SPINLOCK
 	lk->cpu = 0;
 #endif
+#ifdef LOCK_STAT
+	lock_stat_add(lk);
+#endif
 }
 
 // Acquire the lock.
@@ -52,21 +75,51 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket, ahead;
+#ifdef LOCK_STAT
+	uint64_t start = 0;
+	int waited = 0;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
-		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+		panic("CPU %d cannot acquire %s: already holding", thiscpu->cpu_id, lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// The locked xadd is atomic, and serializes, so that reads
+	// after acquire are not reordered before it.
+	ticket = xadd(&lk->next, 1);
+
+	// Interrupts are off in the kernel, so the holder may be waiting
+	// on us to flush our TLB; keep answering while we spin.  The
+	// further back in line we are, the longer we leave the lock's
+	// cache line alone between looks.
+	if ((ahead = ticket - lk->owner) != 0)
+	{
+#ifdef LOCK_STAT
+		start = read_tsc();
+		waited = 1;
+#endif
+		do {
+			tlb_shootdown_poll();
+			while (ahead--)
+				asm volatile ("pause");
+		} while ((ahead = ticket - lk->owner) != 0);
+	}
+
+#ifdef LOCK_STAT
+	lk->acquires++;
+	if (waited)
+	{
+		lk->contended++;
+		lk->spin_cycles += read_tsc() - start;
+	}
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
 	lk->cpu = thiscpu;
-	get_caller_pcs(lk->pcs);
+	lk->pc = (uintptr_t) __builtin_return_address(0);
 #endif
 }
 
@@ -76,26 +129,65 @@ spin_unlock(struct spinlock *lk)
 {
 #ifdef DEBUG_SPINLOCK
 	if (!holding(lk)) {
-		int i;
-		uint32_t pcs[10];
-		// Nab the acquiring EIP chain before it gets released
-		memmove(pcs, lk->pcs, sizeof pcs);
-		printk("CPU %d cannot release %s: held by CPU %d\nAcquired at:", cpunum(), lk->name, lk->cpu->cpu_id);
+		printk("CPU %d cannot release %s: held by CPU %d\nAcquired at: %08x\n",
+		    thiscpu->cpu_id, lk->name, lk->cpu ? lk->cpu->cpu_id : -1, lk->pc);
 		panic("spin_unlock");
 	}
 
-	lk->pcs[0] = 0;
+	lk->pc = 0;
 	lk->cpu = 0;
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	// Only the holder writes owner, so a plain store hands the lock to
+	// the next ticket.  The 2007 Intel 64 Architecture Memory Ordering
+	// White Paper says that Intel 64 and IA-32 will not move a load
+	// after a store, nor reorder stores, so the critical section can't
+	// leak past it; the compiler barrier keeps gcc from moving it
+	// either.
+	asm volatile ("" : : : "memory");
+	lk->owner = lk->owner + 1;
+}
+
+/* This is the system call implementation of get_lock_stat */
+/* Counter 'stat' summed over the locks named like the lock-th name,
+ * which is copied to 'name' unless it is NULL; -1 past the last name,
+ * or if the kernel was built without LOCK_STAT */
+int32_t
+sys_get_lock_stat(int lock, int stat, char *name)
+{
+#ifdef LOCK_STAT
+	struct spinlock *lk;
+	uint64_t val = 0;
+	int i, n;
+
+	if (lock < 0 || stat < 0 || stat >= NLOCKSTATS)
+		return -1;
+	for (i = 0, n = -1; i < nlock_stat; i++)
+		if (lock_stat_first(i) && ++n == lock)
+			break;
+	if (i == nlock_stat)
+		return -1;
+
+	lk = lock_stat_locks[i];
+	for (; i < nlock_stat; i++)
+	{
+		if (strcmp(lock_stat_locks[i]->name, lk->name) != 0)
+			continue;
+		if (stat == LOCK_STAT_ACQUIRES)
+			val += lock_stat_locks[i]->acquires;
+		else if (stat == LOCK_STAT_CONTENDED)
+			val += lock_stat_locks[i]->contended;
+		else
+			val += lock_stat_locks[i]->spin_cycles >> 10;
+	}
+	if (name)
+	{
+		// "&page_lock" reads better as "page_lock"
+		strncpy(name, lk->name + (lk->name[0] == '&'), LOCK_NAME_LEN - 1);
+		name[LOCK_NAME_LEN - 1] = '\0';
+	}
+	return val;
+#else
+	return -1;
+#endif
 }
@@ -6,22 +6,40 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
-// Mutual exclusion lock.
+// Build with LOCKSTAT=1 (defines LOCK_STAT) to count, per lock, the
+// acquisitions, how many had to wait and the cycles spent waiting; see
+// sys_get_lock_stat.  Without it the counting compiles to nothing.
+#define LOCK_STAT_MAX	64	// most locks that are counted
+
+// Mutual exclusion lock.  A ticket lock: every CPU that wants it takes
+// the next ticket and waits for its number to come up, so CPUs get it
+// in the order they asked.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;	// Ticket the next CPU to come gets
+	volatile uint32_t owner;	// Ticket of the holder; held if != next
+
+#if defined(DEBUG_SPINLOCK) || defined(LOCK_STAT)
+	char *name;            // Name of lock.
+#endif
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
-	uintptr_t pcs[10];     // The call stack (an array of program counters)
-	                       // that locked the lock.
+	uintptr_t pc;          // Where the holder locked it
+#endif
+
+#ifdef LOCK_STAT
+	// Only changed by the holder, so on a cache line it owns anyway
+	uint32_t acquires;     // spin_lock calls
+	uint32_t contended;    // ... that found the lock held
+	uint64_t spin_cycles;  // TSC cycles spent waiting for it
 #endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+int32_t sys_get_lock_stat(int lock, int stat, char *name);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 #endif
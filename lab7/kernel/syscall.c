@@ -1,9 +1,11 @@
 #include <kernel/task.h>
 #include <kernel/timer.h>
 #include <kernel/mem.h>
+#include <kernel/kmalloc.h>
 #include <kernel/cpu.h>
 #include <kernel/syscall.h>
 #include <kernel/trap.h>
+#include <kernel/wait.h>
 #include <inc/stdio.h>
 
 void do_puts(char *str, uint32_t len)
@@ -20,10 +22,18 @@ int32_t do_getc()
 	return k_getc();
 }
 
+// The file system calls run one at a time.  They can take long on the
+// disk, so the others wait for their turn asleep, not spinning.
+static struct mutex fs_mutex;
+#define FS_SYSCALL(no)	((no) >= SYS_open && (no) <= SYS_mkdir)
+
 int32_t do_syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t retVal = -1;
 
+	if (FS_SYSCALL(syscallno))
+		mutex_lock(&fs_mutex);
+
 	switch (syscallno)
 	{
 	case SYS_fork:
@@ -59,9 +69,8 @@ int32_t do_syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, ui
      * Yield this task
      * You can reference kernel/sched.c for yielding the task
      */
-    thiscpu->cpu_task->remind_ticks = a1;
-    thiscpu->cpu_task->state = TASK_SLEEP;
-    sched_yield();
+    sched_sleep(a1);
+    retVal = 0;
 		break;
 
 	case SYS_kill:
@@ -137,7 +146,59 @@ int32_t do_syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, ui
   case SYS_mkdir:
     retVal = sys_mkdir(a1);
     break;
+
+  case SYS_get_num_free_block:
+    retVal = sys_get_num_free_block(a1);
+    break;
+
+  case SYS_get_cpu_stat:
+    if (a1 < ncpu && a2 < NCPUSTATS)
+      retVal = cpus[a1].cpu_stat[a2];
+    break;
+
+  case SYS_get_kmem_stat:
+    retVal = sys_get_kmem_stat(a1, a2);
+    break;
+
+  case SYS_get_lock_stat:
+    retVal = sys_get_lock_stat(a1, a2, (char *) a3);
+    break;
+
+  case SYS_setpriority:
+    retVal = sys_setpriority(a1, a2);
+    break;
+
+  case SYS_nice:
+    retVal = sys_nice(a1);
+    break;
+
+  case SYS_nanosleep:
+    retVal = sys_nanosleep(a1, a2);
+    break;
+
+  case SYS_migrate:
+    retVal = sys_migrate(a1, a2);
+    break;
+
+  case SYS_sched_setdeadline:
+    retVal = sys_sched_setdeadline(a1, a2, a3);
+    break;
+
+  case SYS_sched_setaffinity:
+    retVal = sys_sched_setaffinity(a1, a2);
+    break;
+
+  case SYS_sched_getaffinity:
+    retVal = sys_sched_getaffinity(a1);
+    break;
+
+  case SYS_set_stack_limit:
+    retVal = sys_set_stack_limit(a1);
+    break;
   }
+
+	if (FS_SYSCALL(syscallno))
+		mutex_unlock(&fs_mutex);
 	return retVal;
 }
 
@@ -160,5 +221,6 @@ void syscall_init()
    */
   extern void sys_call();
   register_handler(T_SYSCALL, syscall_handler, sys_call, 1, 3);
+  mutex_init(&fs_mutex);
 }
 
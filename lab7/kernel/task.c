@@ -2,11 +2,13 @@
 #include <inc/types.h>
 #include <inc/string.h>
 #include <inc/x86.h>
+#include <inc/assert.h>
 #include <inc/memlayout.h>
 #include <kernel/task.h>
 #include <kernel/mem.h>
 #include <kernel/cpu.h>
 #include <kernel/spinlock.h>
+#include <kernel/wait.h>
 
 // Global descriptor table.
 //
@@ -23,7 +25,7 @@
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -42,8 +44,12 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// First TSS descriptors (starting from GD_TSS0) are initialized
 	// in task_init()
-	[GD_TSS0 >> 3] = SEG_NULL
-	
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Then the per-CPU data segments (starting from GD_CPU0), set up
+	// by percpu_init()
+	[GD_CPU0 >> 3] = SEG_NULL
+
 };
 
 struct Pseudodesc gdt_pd = {
@@ -69,7 +75,9 @@ uint32_t URODATA_SZ;
 
 Task *cur_task = NULL; //Current running task
 
-struct spinlock tasks_lock;
+/* Task slots in use, bit i for tasks[i].  Slots are taken and given
+ * back with cmpxchg, so creating and killing tasks takes no lock. */
+static volatile uint32_t task_slots[(NR_TASKS + 31) / 32];
 extern void sched_yield(void);
 
 
@@ -84,8 +92,10 @@ extern void sched_yield(void);
  * 3. Setup the user stack for the new task, you can use
  *    page_alloc() and page_insert(), noted that the va
  *    of user stack is started at USTACKTOP and grows down
- *    to USR_STACK_SIZE, remember that the permission of
- *    those pages should include PTE_U
+ *    to stack_limit, remember that the permission of
+ *    those pages should include PTE_U.  Only the page under
+ *    the initial esp is mapped here, the rest is mapped by
+ *    task_stack_fault when the task first touches it.
  *
  * 4. Setup the Trapframe for the new task
  *    We've done this for you, please make sure you
@@ -98,45 +108,98 @@ extern void sched_yield(void);
  * 6. Return the pid of the newly created task.
  
  */
-int task_create()
+
+/* Take a free task slot; returns its pid, or -1 if all are in use */
+static int task_slot_get()
 {
-	Task *ts = NULL;
+	uint32_t w;
+	int i, bit;
 
-	/* Find a free task structure */
-    spin_lock(&tasks_lock);
-	int i;
-	for (i = 0; i < NR_TASKS; i++)
+	for (i = 0; i < (NR_TASKS + 31) / 32; i++)
 	{
-		if(tasks[i].state == TASK_FREE)
+		while ((w = task_slots[i]) != ~0U)
 		{
-			ts = &tasks[i];
-			ts->task_id = i;
-			break;
+			bit = __builtin_ctz(~w);
+			if (i * 32 + bit >= NR_TASKS)
+				return -1;
+			if (cmpxchg(&task_slots[i], w, w | (1U << bit)) == w)
+				return i * 32 + bit;
 		}
 	}
-	if (i==NR_TASKS-1)
-	{
-		spin_unlock(&tasks_lock);
-		return -1;
-	}
+	return -1;
+}
+
+/* Give the slot of a freed task back */
+static void task_slot_put(int pid)
+{
+	uint32_t w;
+
+	do
+		w = task_slots[pid / 32];
+	while (cmpxchg(&task_slots[pid / 32], w, w & ~(1U << (pid % 32))) != w);
+}
+
+//
+// Make up a kernel context on the empty kernel stack of 'ts', below
+// its trap frame, so that the first switch_to it calls 'entry', which
+// must not return.
+//
+static void
+task_kctx_init(Task *ts, void (*entry)(void))
+{
+	char *sp = (char *) ts->tf;
+
+	// a return address for entry that is never used
+	sp -= sizeof(uint32_t);
+	*(uint32_t *) sp = 0;
+	sp -= sizeof(struct Context);
+	ts->kctx = (struct Context *) sp;
+	memset(ts->kctx, 0, sizeof(struct Context));
+	ts->kctx->eip = (uint32_t) entry;
+}
+
+/*
+ * Steps 1, 2, 4 and 5 of task_create: a task with a page directory
+ * but no user stack, which sys_fork shares with the parent instead.
+ * Returns the new task, or NULL if every task structure is in use or
+ * memory ran out.
+ */
+static Task *task_alloc()
+{
+	Task *ts;
+	int i;
+
+	/* Find a free task structure */
+	if ((i = task_slot_get()) < 0)
+		return NULL;
+	ts = &tasks[i];
+	ts->task_id = i;
 	/* Setup Page Directory and pages for kernel*/
 	if (!(ts->pgdir = setupkvm()))
-		panic("Not enough memory for per process page directory!\n");
-
-	/* Setup User Stack */
-	for(i=USTACKTOP-USR_STACK_SIZE; i<USTACKTOP; i+=PGSIZE)
 	{
-		struct PageInfo *u_stack = page_alloc(ALLOC_ZERO);
-		page_insert(ts->pgdir, u_stack, i, PTE_U|PTE_W|PTE_P);
+		task_slot_put(i);
+		return NULL;
+	}
+	/* Kernel stack, which the task enters user mode from first */
+	if (!(ts->kstack = kmalloc(TASK_KSTKSIZE)))
+	{
+		pgdir_remove(ts->pgdir);
+		task_slot_put(i);
+		return NULL;
 	}
+	ts->tf = TASK_TF(ts);
+	task_kctx_init(ts, task_start);
+	ts->on_cpu = 0;
+
 	/* Setup Trapframe */
-	memset( &(ts->tf), 0, sizeof(ts->tf));
+	memset(ts->tf, 0, sizeof(*ts->tf));
 
-	ts->tf.tf_cs = GD_UT | 0x03;
-	ts->tf.tf_ds = GD_UD | 0x03;
-	ts->tf.tf_es = GD_UD | 0x03;
-	ts->tf.tf_ss = GD_UD | 0x03;
-	ts->tf.tf_esp = USTACKTOP-PGSIZE;
+	ts->tf->tf_cs = GD_UT | 0x03;
+	ts->tf->tf_ds = GD_UD | 0x03;
+	ts->tf->tf_es = GD_UD | 0x03;
+	ts->tf->tf_ss = GD_UD | 0x03;
+	ts->tf->tf_esp = USTACKTOP-PGSIZE;
+	ts->stack_limit = USR_STACK_SIZE;
 
 	/* Setup task structure (task_id and parent_id) */
 	// int task_id;
@@ -147,12 +210,88 @@ int task_create()
 		ts->parent_id = 0;
 	else
 		ts->parent_id = thiscpu->cpu_task->parent_id;
-	ts->remind_ticks = TIME_QUANT;
+	ts->nice = 0;
+	ts->cpus_allowed = CPU_MASK_ALL;
+	ts->rq_next = ts->rq_prev = NULL;
+	ts->rq_array = NULL;
+	ts->on_rq = 0;
+	ts->vruntime = 0;
+	ts->dl_runtime = ts->dl_bw = 0;
+	ts->dl_throttled = 0;
+	memset(&ts->dl_timer, 0, sizeof(ts->dl_timer));
+	ts->tw_slot = NULL;
+	ts->wq = NULL;
+	ts->wq_next = NULL;
+	ts->mutexes = 0;
+	ts->killed = 0;
+	ts->remind_ticks = TASK_TIMESLICE(ts);
 	ts->state = TASK_RUNNABLE;
-    spin_unlock(&tasks_lock);
+	return ts;
+}
+
+/*
+ * Undo task_alloc for a task that never ran, along with whatever got
+ * mapped in its page directory since
+ */
+static void task_unalloc(Task *ts)
+{
+	ts->state = TASK_FREE;
+	ptable_remove(ts->pgdir);
+	pgdir_remove(ts->pgdir);
+	task_release(ts);
+}
+
+int task_create()
+{
+	Task *ts = task_alloc();
+
+	if (ts == NULL)
+		return -1;
+
+	/* Setup User Stack */
+	if (task_stack_fault(ts, ts->tf->tf_esp - 4) < 0)
+	{
+		task_unalloc(ts);
+		return -1;
+	}
 	return ts->task_id;
 }
 
+/*
+ * Map a zeroed page at 'va' if it lies in the user stack of 'ts' and
+ * within its stack_limit.  Called for not-present page faults, so the
+ * stack grows on demand.  Returns 0 on success, -1 otherwise.
+ */
+int task_stack_fault(Task *ts, uint32_t va)
+{
+	struct PageInfo *pp;
+
+	if (va >= USTACKTOP || va < USTACKTOP - ts->stack_limit)
+		return -1;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -1;
+	if (page_insert(ts->pgdir, pp, (void *)ROUNDDOWN(va, PGSIZE), PTE_U|PTE_W|PTE_P) < 0)
+	{
+		page_free(pp);
+		return -1;
+	}
+	return 0;
+}
+
+/* This is the system call implementation of set_stack_limit */
+/* Let the user stack grow to 'bytes', rounded up to whole pages.  -1
+ * past USR_STACK_MAX, or short of the stack the task is using now. */
+int sys_set_stack_limit(uint32_t bytes)
+{
+	Task *cur = thiscpu->cpu_task;
+
+	bytes = ROUNDUP(bytes, PGSIZE);
+	if (bytes == 0 || bytes > USR_STACK_MAX || bytes < USTACKTOP - ROUNDDOWN(cur->tf->tf_esp, PGSIZE))
+		return -1;
+	cur->stack_limit = bytes;
+	return 0;
+}
+
 
 /* TODO: Lab5
  * This function free the memory allocated by kernel.
@@ -175,39 +314,109 @@ int task_create()
 
 static void task_free(int pid)
 {
-	Task *ts = NULL;
-	int i=0;
-	for (i = 0; i < NR_TASKS; i++)
-	{
-		if(tasks[i].task_id == pid)
-		{
-			ts = &tasks[i];
-			break;
-		}
-	}
+	Task *ts = &tasks[pid];
 
-	// extern pde_t *kern_pgdir;
-	lcr3(PADDR(kern_pgdir));
-	
-	/*remove pages of USER STACK */
-	for(i=USTACKTOP-USR_STACK_SIZE; i<USTACKTOP; i+=PGSIZE)
-	{
-		page_remove(ts->pgdir, i);
-	}
+	// a CPU that just switched away from it may not be done yet
+	while (ts->on_cpu && ts != thiscpu->cpu_task)
+		asm volatile ("pause");
 
-	/*remove pages of page table*/
+	// only our own page directory is loaded here; when freeing
+	// another task keep ours, we may iret back to user mode with it
+	if (ts == thiscpu->cpu_task)
+		load_pgdir(kern_pgdir);
+	
+	/*remove pages of USER STACK and of page table: ptable_remove
+	 * drops the pages mapped in the page tables it frees */
 	ptable_remove(ts->pgdir);
 
 	/*remove pages of page directory*/
 	pgdir_remove(ts->pgdir);
 
+	/* we may be on its kernel stack still: then sched_finish lets go
+	 * of it once we have switched away */
+	if (ts == thiscpu->cpu_task)
+		thiscpu->cpu_dead = ts;
+	else
+		task_release(ts);
+}
+
+//
+// Free the kernel stack of the dead task 'ts', no longer in use, and
+// give its slot back
+//
+void task_release(Task *ts)
+{
+	kfree(ts->kstack);
+	ts->kstack = NULL;
+	ts->on_cpu = 0;
+	/* only now can the slot be used again */
+	task_slot_put(ts->task_id);
+}
+
+static void kill_call(uint32_t pid, uint32_t unused);
+
+//
+// Kill task 'pid' if it is on this CPU.  Returns -1 if it is on
+// another one.
+//
+static int
+task_kill_here(int pid)
+{
+	Runqueue *rq = &thiscpu->cpu_rq;
+
+	/* a task only changes CPU under its runqueue's lock */
+	spin_lock(&rq->lock);
+	if(thiscpu->cpu_id != tasks[pid].cpu_id)
+	{
+		spin_unlock(&rq->lock);
+		return -1;
+	}
+	/* the idle task has to stay */
+	if(&tasks[pid] == rq->idle || tasks[pid].state == TASK_FREE)
+	{
+		spin_unlock(&rq->lock);
+		return 0;
+	}
+	/* migrate_call gave it to us while it still runs where it came
+	 * from, which hands it over once it stops (see sched_yield) */
+	if (tasks[pid].state == TASK_RUNNING && &tasks[pid] != thiscpu->cpu_task)
+	{
+		spin_unlock(&rq->lock);
+		xcall_post(thiscpu->cpu_id, kill_call, pid, 0);
+		return 0;
+	}
+	/* it is in a system call holding a mutex, asleep or about to run:
+	 * let it finish the call and die on its way out (see trap_dispatch),
+	 * or the mutex would stay locked */
+	if (tasks[pid].mutexes > 0)
+	{
+		tasks[pid].killed = 1;
+		spin_unlock(&rq->lock);
+		return 0;
+	}
+	rq_remove(rq, &tasks[pid]);
+	wq_cancel(&tasks[pid]);
+	sched_dl_exit(rq, &tasks[pid]);
+	spin_unlock(&rq->lock);
+
+	tasks[pid].state = TASK_FREE;
+	task_free(pid);
+	return 0;
+}
+
+// Kill task 'pid' on the CPU it is on, following it there if it moved
+// on before this ran (see xcall_handler for killing a running task)
+static void
+kill_call(uint32_t pid, uint32_t unused)
+{
+	if (task_kill_here(pid) < 0)
+		xcall_post(tasks[pid].cpu_id, kill_call, pid, 0);
 }
 
 // Lab6 TODO
 //
-// Modify it so that the task will be removed form cpu runqueue
-// ( we not implement signal yet so do not try to kill process
-// running on other cpu )
+// Modify it so that the task will be removed form cpu runqueue.
+// A task on another CPU is killed there, with a cross-call.
 //
 void sys_kill(int pid)
 {
@@ -218,27 +427,10 @@ void sys_kill(int pid)
    * Free the memory
    * and invoke the scheduler for yield
    */
-		if(thiscpu->cpu_id != tasks[pid].cpu_id)
-			return;
-		if(thiscpu->cpu_rq.total > 1)
-		{
-			int i=0;
-			for(i;i<thiscpu->cpu_rq.total;i++)
-			{
-				if(thiscpu->cpu_rq.runq[i]==pid)
-				{
-					int last = thiscpu->cpu_rq.runq[ thiscpu->cpu_rq.total-1 ];
-					thiscpu->cpu_rq.runq[i] = last;
-					thiscpu->cpu_rq.total--;
-					break;
-				}
-			}
-		}
-		spin_lock(&tasks_lock);
-		tasks[pid].state = TASK_FREE;
-		task_free(pid);
-		spin_unlock(&tasks_lock);
-		sched_yield();
+		if (task_kill_here(pid) < 0)
+			xcall_post(tasks[pid].cpu_id, kill_call, pid, 0);
+		else if (thiscpu->cpu_task->state != TASK_RUNNING)
+			sched_yield();
 	}
 }
 
@@ -250,9 +442,9 @@ void sys_kill(int pid)
  *
  * 2. Copy the trap frame of the parent to the child
  *
- * 3. Copy the content of the old stack to the new one,
- *    you can use memcpy to do the job. Remember all the
- *    address you use should be virtual address.
+ * 3. Share the old stack with the new task copy-on-write;
+ *    a stack page is only copied when one of the two tasks
+ *    writes to it (see page_cow_fault in kernel/mem.c).
  *
  * 4. Setup virtual memory mapping of the user prgram 
  *    in the new task's page table.
@@ -276,59 +468,53 @@ void sys_kill(int pid)
 int sys_fork()
 {
 	/* pid for newly created process */
-	static int lastcpu = 0;
-
 	int pid;
-	pid = task_create();
-	if(pid ==-1)
+	struct CpuInfo *c = thiscpu;
+	Task *ts = task_alloc();
+	if(ts == NULL)
 		return -1;
+	pid = ts->task_id;
 	/* Step 2:Copy the trap frame of the parent to the child*/
-	memcpy(&tasks[pid].tf, &thiscpu->cpu_task->tf, sizeof(struct Trapframe));
-	/* Step 3:Copy the content of the old stack to the new one*/
+	memcpy(tasks[pid].tf, thiscpu->cpu_task->tf, sizeof(struct Trapframe));
+	/* Step 3:Share the old stack with the child, copy-on-write*/
 	int i;
-	for(i=USTACKTOP-USR_STACK_SIZE; i<USTACKTOP; i+=PGSIZE)
+	ts->stack_limit = thiscpu->cpu_task->stack_limit;
+	ts->nice = thiscpu->cpu_task->nice;
+	ts->cpus_allowed = thiscpu->cpu_task->cpus_allowed;
+	ts->remind_ticks = TASK_TIMESLICE(ts);
+	for(i=USTACKTOP-ts->stack_limit; i<USTACKTOP; i+=PGSIZE)
 	{
-		//find old stack physical address
-		pte_t* old_stack = pgdir_walk(thiscpu->cpu_task->pgdir, i, 0);
-		if (old_stack==NULL | (!(*old_stack & PTE_P)))
-		{
-			cprintf("sys_fork has error because old stack does not exist.\n");
+		if (page_share_cow(ts->pgdir, thiscpu->cpu_task->pgdir, (void *)i) < 0)
 			break;
-		}
-		physaddr_t old_stack_addr = PTE_ADDR(*old_stack);
-
-		//find new stack physical address
-		pte_t* new_stack = pgdir_walk(tasks[pid].pgdir, i, 0);
-		if (new_stack==NULL | (!(*new_stack & PTE_P)))
-		{
-			cprintf("sys_fork has error because new stack does not exist.\n");
-			break;
-		}
-		physaddr_t new_stack_addr = PTE_ADDR(*new_stack);
-
-		//copy
-		
-		memcpy((char*)KADDR(new_stack_addr), (char*)KADDR(old_stack_addr), PGSIZE);
+	}
+	/* the parent's pages shared so far are read-only now either way */
+	tlb_shootdown(thiscpu->cpu_task->pgdir, (void *)(USTACKTOP-ts->stack_limit), ts->stack_limit/PGSIZE);
+	if (i < USTACKTOP)
+	{
+		/* out of memory for the child's page tables: the parent
+		 * takes its pages back on its next write (page_cow_fault) */
+		task_unalloc(ts);
+		return -1;
 	}
 
 	if ((uint32_t)thiscpu->cpu_task)
 	{
-		/* Step 4: All user program use the same code for now */
-		setupvm(tasks[pid].pgdir, (uint32_t)UTEXT_start, UTEXT_SZ);
-		setupvm(tasks[pid].pgdir, (uint32_t)UDATA_start, UDATA_SZ);
-		setupvm(tasks[pid].pgdir, (uint32_t)UBSS_start, UBSS_SZ);
-		setupvm(tasks[pid].pgdir, (uint32_t)URODATA_start, URODATA_SZ);
+		/* Step 4: All user program use the same code for now,
+		 * and it is already mapped in the page tables that
+		 * setupkvm shares with kern_pgdir (see task_init) */
 
 		/*Step 5: Return value*/
-		tasks[pid].tf.tf_regs.reg_eax = 0;
-		thiscpu->cpu_task->tf.tf_regs.reg_eax = pid;
+		tasks[pid].tf->tf_regs.reg_eax = 0;
+		thiscpu->cpu_task->tf->tf_regs.reg_eax = pid;
 	}
-	spin_lock(&tasks_lock);
-    lastcpu = (lastcpu+1) % ncpu;
-    tasks[pid].cpu_id = lastcpu;
-    cpus[lastcpu].cpu_rq.runq[cpus[lastcpu].cpu_rq.total] = pid;
-    cpus[lastcpu].cpu_rq.total++;
-	spin_unlock(&tasks_lock);
+	/* each CPU deals its children out round-robin, starting with
+	 * the next CPU after itself, over the CPUs the child may run on */
+	do
+		c->cpu_next_fork = (c->cpu_next_fork + 1) % ncpu;
+	while (!TASK_ALLOWED(ts, c->cpu_next_fork));
+	tasks[pid].cpu_id = c->cpu_next_fork;
+
+	sched_wake(&tasks[pid]);
 	return pid;
 }
 
@@ -338,7 +524,7 @@ int sys_fork()
  */
 void task_init()
 {
-	spin_initlock(&tasks_lock);
+	sched_init();
 	extern int user_entry();
 	int i;
 	UTEXT_SZ = (uint32_t)(UTEXT_end - UTEXT_start);
@@ -346,6 +532,13 @@ void task_init()
 	UBSS_SZ = (uint32_t)(UBSS_end - UBSS_start);
 	URODATA_SZ = (uint32_t)(URODATA_end - URODATA_start);
 
+	/* For user program: every task shares the kernel's page tables
+	 * above UTOP, so the user image only needs to be mapped once */
+	setupvm(kern_pgdir, (uint32_t)UTEXT_start, UTEXT_SZ);
+	setupvm(kern_pgdir, (uint32_t)UDATA_start, UDATA_SZ);
+	setupvm(kern_pgdir, (uint32_t)UBSS_start, UBSS_SZ);
+	setupvm(kern_pgdir, (uint32_t)URODATA_start, URODATA_SZ);
+
 	/* Initial task sturcture */
 	for (i = 0; i < NR_TASKS; i++)
 	{
@@ -366,6 +559,23 @@ void task_init()
 // 2. init per-CPU Runqueue
 //
 // 3. init per-CPU system registers
+//
+// Make %gs of this CPU, number 'id', cover cpus[id], so thiscpu needs
+// no more than one load.  Runs first thing on every CPU, before
+// anything uses thiscpu.  _alltraps loads %gs again on every trap, in
+// case user mode changed it.
+//
+void percpu_init(int id)
+{
+	static_assert(GD_CPU0 == GD_TSS0 + (NCPU << 3));
+
+	cpus[id].cpu_self = &cpus[id];
+	gdt[(GD_CPU0 >> 3) + id] = SEG(STA_W, (uint32_t) &cpus[id],
+	    sizeof(struct CpuInfo) - 1, 0);
+	lgdt(&gdt_pd);
+	__asm __volatile("movw %w0, %%gs" : : "r" (GD_CPU0 + (id << 3)));
+}
+
 //
 // 4. init per-CPU TSS
 //
@@ -374,12 +584,12 @@ void task_init_percpu()
 	int i;
 	static flag = 1;
 	extern int user_entry();
-	extern int idle_entry();
-	int j=cpunum();
+	int j=thiscpu->cpu_id;
 	
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
 	memset(&(cpus[j].cpu_tss), 0, sizeof(cpus[j].cpu_tss));
+	// sched_yield moves esp0 to the kernel stack of each task it runs
 	cpus[j].cpu_tss.ts_esp0 = (uint32_t)percpu_kstacks[cpus[j].cpu_id] + KSTKSIZE;
 	cpus[j].cpu_tss.ts_ss0 = GD_KD;
 
@@ -390,34 +600,34 @@ void task_init_percpu()
 	/* Setup TSS in GDT */
 	gdt[(GD_TSS0 >> 3) + j] = SEG16(STS_T32A, (uint32_t)(&cpus[j].cpu_tss), sizeof(struct tss_struct), 0);
 	gdt[(GD_TSS0 >> 3) + j].sd_s = 0;
-	/* Setup first task */
-	i = task_create();
-	cpus[j].cpu_task = &(tasks[i]);
-
-	/* For user program */
-	setupvm(cpus[j].cpu_task->pgdir, (uint32_t)UTEXT_start, UTEXT_SZ);
-	setupvm(cpus[j].cpu_task->pgdir, (uint32_t)UDATA_start, UDATA_SZ);
-	setupvm(cpus[j].cpu_task->pgdir, (uint32_t)UBSS_start, UBSS_SZ);
-	setupvm(cpus[j].cpu_task->pgdir, (uint32_t)URODATA_start, URODATA_SZ);
-// <<<<<<< HEAD
-// =======
+	/* Setup run queue and hrtimers */
+	rq_init(&cpus[j].cpu_rq);
+	cpus[j].cpu_hrtimers = NULL;
+	spin_initlock(&cpus[j].cpu_hrtimer_lock);
+
+	/* Setup first task: the shell on the boot CPU */
 	if(flag)
 	{
-		cpus[j].cpu_task->tf.tf_eip = (uint32_t)user_entry;
-		cpus[j].cpu_task->state = TASK_RUNNING;
+		i = task_create();
+		tasks[i].tf->tf_eip = (uint32_t)user_entry;
+		tasks[i].tf->tf_eflags = FL_IF;
+		tasks[i].cpu_id = cpus[j].cpu_id;
+		tasks[i].state = TASK_RUNNING;
+		cpus[j].cpu_task = &(tasks[i]);
 		flag=0;
 	}
-	else
+
+	/* Every CPU has an idle task, which stands for sched_idle when
+	 * nothing else can run; it never goes to user mode */
+	i = task_create();
+	tasks[i].cpu_id = cpus[j].cpu_id;
+	task_kctx_init(&tasks[i], sched_idle);
+	cpus[j].cpu_rq.idle = &(tasks[i]);
+	if(cpus[j].cpu_task == NULL)
 	{
-		cpus[j].cpu_task->tf.tf_eip = (uint32_t)idle_entry;
-		cpus[j].cpu_task->state = TASK_RUNNING;
+		tasks[i].state = TASK_RUNNING;
+		cpus[j].cpu_task = &(tasks[i]);
 	}
-	
-	/* Setup run queue */
-	memset(&(cpus[j].cpu_rq), 0, sizeof(cpus[j].cpu_rq));
-	cpus[j].cpu_rq.runq[0] = i;
-	cpus[j].cpu_rq.current_index = 0;
-	cpus[j].cpu_rq.total = 1;
 
 	/* Load GDT&LDT */
 	lgdt(&gdt_pd);
@@ -3,6 +3,9 @@
 
 #include <inc/trap.h>
 #include <kernel/mem.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/xcall.h>
 #define NR_TASKS	20
 #define TIME_QUANT	100
 
@@ -16,37 +19,198 @@ typedef enum
 } TaskState;
 
 // Each task's user space
-#define USR_STACK_SIZE	(40960)
+// USR_STACK_MAX bytes below USTACKTOP are reserved for the user stack.
+// Stack pages are mapped on first touch (see task_stack_fault), down to
+// the task's stack_limit, which starts out as USR_STACK_SIZE; a task
+// can raise it up to USR_STACK_MAX with set_stack_limit, and children
+// inherit it.
+#define USR_STACK_MAX	(8*1024*1024)
+#define USR_STACK_SIZE	(1024*1024)
 
-typedef struct
+// Scheduling priorities.  A task's nice value, -20 (most favoured) to
+// 19, maps to one of NR_PRIO priority levels, 0 being the highest.
+// Better priorities also get longer time slices.
+#define NICE_MIN	(-20)
+#define NICE_MAX	19
+#define NR_PRIO		(NICE_MAX - NICE_MIN + 1)
+#define NICE_TO_PRIO(nice)	((nice) - NICE_MIN)
+#define TASK_TIMESLICE(ts)	(TIME_QUANT * (20 - (ts)->nice) / 20)
+
+// Every task has a kernel stack of its own: its system calls and
+// interrupts run there, and it keeps its kernel context there while it
+// sleeps or waits to run, so it can block anywhere in the kernel.
+#define TASK_KSTKSIZE	(4*PGSIZE)
+
+// Traps from user mode start on an empty kernel stack (see
+// sched_yield), so a task's trap frame is always at the top of its
+// own, and stays there while other tasks run: trap entry builds it in
+// place, and nothing copies it.
+#define TASK_TF(ts)	((struct Trapframe *) ((char *) (ts)->kstack + TASK_KSTKSIZE) - 1)
+
+// What switch_to saves on the kernel stack it switches away from: the
+// registers a C caller expects to survive the call, and where to go
+// back to.  A new task gets one made up by task_kctx_init.
+struct Context {
+	uint32_t edi;
+	uint32_t esi;
+	uint32_t ebx;
+	uint32_t ebp;
+	uint32_t eip;
+};
+
+struct PrioArray;
+struct waitqueue;
+
+typedef struct Task
 {
 	int task_id;
 	int parent_id;
     int cpu_id;
-	struct Trapframe tf; //Saved registers
+	struct Trapframe *tf; //Saved registers, at the top of kstack
+	void *kstack;		//Kernel stack, TASK_KSTKSIZE bytes
+	struct Context *kctx;	//Saved kernel context, while not running
+	volatile uint8_t on_cpu;	//A CPU is still on our kernel stack
 	int32_t remind_ticks;
 	TaskState state;	//Task state
 	pde_t *pgdir;  //Per process Page Directory
+	uint32_t stack_limit;	//Max bytes of user stack, at most USR_STACK_MAX
+	int32_t nice;		//Scheduling priority, NICE_MIN to NICE_MAX
+	uint32_t cpus_allowed;	//Bit i set if the task may run on CPU i
+	uint8_t on_rq;		//Queued in the scheduling class, waiting to run
+	struct Task *rq_next;	//Links on a priority queue or the sleep queue
+	struct Task *rq_prev;
+	struct PrioArray *rq_array;	//Priority array we are queued on, if any
+	uint64_t vruntime;	//CFS: weighted time run, in us
+	uint64_t exec_start;	//CFS, EDF: timer_now_us() when last accounted
+	uint32_t slice_used;	//CFS: us run since last picked
+	struct Task *cfs_left;	//CFS: children in the vruntime tree
+	struct Task *cfs_right;
+	int32_t cfs_height;
+	uint32_t dl_runtime;	//EDF: us of CPU per period; 0 if not EDF
+	uint32_t dl_period;	//EDF: us
+	uint32_t dl_deadline;	//EDF: us into the period the runtime is due
+	uint32_t dl_bw;		//EDF: runtime / period, as admitted
+	int32_t dl_remaining;	//EDF: us of runtime left for the current job
+	uint64_t dl_abs_deadline;	//EDF: timer_now_us() the current job is due
+	uint8_t dl_throttled;	//EDF: out of runtime until the next period
+	uint8_t dl_missed;	//EDF: current job missed its deadline
+	struct hrtimer dl_timer;	//EDF: ends the runtime or the throttling
+	uint32_t last_ran;	//Runqueue clock when we last stopped running
+	uint32_t wake_at;	//Runqueue clock to wake up at, while in TASK_SLEEP
+	struct Task **tw_slot;	//Timer wheel slot we sleep on
+	struct hrtimer sleep_timer;	//Wakes us from nanosleep
+	struct waitqueue *wq;	//Wait queue we sleep on, if any
+	struct Task *wq_next;	//Next sleeper on it
+	int32_t mutexes;	//Mutexes held (see mutex_lock)
+	uint8_t killed;		//Killed holding a mutex: dies on its way out
+	struct xcall arrive;	//Hands us to another CPU (see task_send)
 	
 } Task;
 
-// TODO Lab6
-// 
-// Design your Runqueue structure for cpu
-// your runqueue sould have at least two
-// variables:
-//
-// 1. an index for Round-robin scheduling
+// Runnable tasks wait in FIFO queues, one per priority level, and
+// a bitmap records which queues are non-empty, so the next task is
+// found with a find-first-set however many tasks there are.
+struct PrioQueue {
+	Task *head;
+	Task *tail;
+};
+
+struct PrioArray {
+	uint32_t bitmap[(NR_PRIO + 31) / 32];	// bit p set: queue[p] is non-empty
+	struct PrioQueue queue[NR_PRIO];
+	int nr_tasks;
+};
+
+// Per-CPU runqueue.  Which runnable task runs next is up to the
+// scheduling class (see struct SchedClass).  With the priority class,
+// tasks whose time slice runs out move from the active array to the
+// expired one; once no active task is left the two swap, so every
+// runnable task gets its turn and all of it is O(1).  The CFS class
+// keeps them in a tree by vruntime instead.  Sleeping tasks are on the
+// timer wheel, and running tasks on no queue at all.  The idle task
+// only runs when no other task is queued.
 //
-// 2. a list indicate the tasks in the runqueue
+// Runnable tasks move between CPUs: an idle CPU steals from the
+// busiest one, and busy CPUs even out their loads every BALANCE_TICKS
+// (see rq_balance).  A runqueue's lock protects all of it; to hold two
+// at once, take the lower CPU's first.  Apart from the balancer, only
+// a CPU itself queues tasks on its runqueue: new and migrated tasks
+// are handed to it with a cross-call (see task_send).
 //
+// Lock order: runqueue locks, then cpu_hrtimer_lock, then km_lock,
+// then page_lock; wait queue locks, zero_lock and console_lock never
+// have another lock taken under them.  Task slots need no lock at all
+// (see task_slot_get).
+#define BALANCE_TICKS	50	// busy CPUs balance this often
+#define CACHE_HOT_TICKS	5	// tasks that ran this recently stay put
+#define TASK_CACHE_HOT(rq, ts)	((rq)->clock - (ts)->last_ran < CACHE_HOT_TICKS)
+#define TASK_ALLOWED(ts, cpu)	((ts)->cpus_allowed & (1 << (cpu)))
+#define CPU_MASK_ALL	((1 << NCPU) - 1)
+#define NOHZ_IDLE_TICKS	10	// most ticks an idle CPU skips
+
+// Sleeping tasks wait on a hierarchical timer wheel, one per CPU.
+// Level 0 has a slot for each of the next TW_SIZE ticks, and every
+// level above has slots TW_SIZE times as coarse; whenever level 0 wraps
+// around, the next slot of level 1 is spread out over level 0, and so
+// on up.  Going to sleep and each tick are O(1) however many tasks
+// sleep.  Sleeps are cut at TW_SIZE^TW_LEVELS ticks (about 46 hours).
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_LEVELS	4
+#define TW_MAX		((1 << (TW_BITS * TW_LEVELS)) - 1)
+
+struct TimerWheel {
+	Task *slot[TW_LEVELS][TW_SIZE];
+};
+
 typedef struct
 {
-    int total;
-    int current_index;
-    int runq[NR_TASKS];
+    struct spinlock lock;
+    uint32_t clock;		// timer ticks seen by this CPU
+    int nr_queued;		// tasks waiting to run, in whichever class
+    int need_resched;		// a woken task should preempt the current one
+    struct PrioArray arrays[2];	// priority class
+    struct PrioArray *active;
+    struct PrioArray *expired;
+    Task *cfs_root;		// CFS class: queued tasks by vruntime
+    uint32_t cfs_load;		// CFS class: total weight of the queued tasks
+    uint64_t min_vruntime;	// CFS class: never goes backwards
+    Task *dl_head;		// EDF class: queued tasks, earliest deadline first
+    uint32_t dl_bw;		// EDF class: bandwidth admitted on this CPU
+    struct TimerWheel wheel;	// tasks in TASK_SLEEP
+    Task *idle;		// this CPU's idle task
 } Runqueue;
 
+// A scheduling class decides in which order the queued tasks of a CPU
+// run and for how long.  One normal class, picked by name at boot (see
+// sched_init), schedules every task but the ones that declared a
+// deadline (see sys_sched_setdeadline), which belong to the EDF class
+// and always run first.  All of these are called with the runqueue's
+// lock held; the idle task never gets to a class.
+struct SchedClass {
+	const char *name;
+	void (*init)(Runqueue *rq);
+	// 'ts' waits to run; 'wakeup' if it was asleep or is new.  Returns
+	// 0 if the class holds it back instead (a throttled EDF task).
+	int (*enqueue)(Runqueue *rq, Task *ts, int wakeup);
+	// 'ts' no longer waits, to be killed or to go to another CPU
+	void (*dequeue)(Runqueue *rq, Task *ts);
+	// the running task 'ts' is switched out but still runnable;
+	// returns 0 like enqueue
+	int (*put_prev)(Runqueue *rq, Task *ts);
+	// take the task to run next off the queue; NULL if there is none
+	Task *(*pick_next)(Runqueue *rq);
+	// the running task 'cur' ran for 'ticks' more; 1 to preempt it
+	int (*tick)(Runqueue *rq, Task *cur, uint32_t ticks);
+	// 1 if the woken task 'ts' should preempt the running 'cur'
+	int (*preempt)(Runqueue *rq, Task *cur, Task *ts);
+	// a queued task the balancer could move to CPU 'cpu' (see rq_balance)
+	Task *(*pick_migratable)(Runqueue *rq, int hot_ok, int cpu);
+};
+
+extern struct SchedClass sched_prio, sched_cfs, sched_dl, *sched_class;
+#define TASK_CLASS(ts)	((ts)->dl_runtime ? &sched_dl : sched_class)
+
 
 void task_init();
 void task_init_percpu();
@@ -59,4 +223,33 @@ void env_pop_tf(struct Trapframe *tf);
 void sys_kill(int pid);
 int sys_fork();
 
+/* Scheduler, in kernel/sched.c.  Callers of rq_* hold the rq's lock. */
+void sched_init(void);
+void rq_init(Runqueue *rq);
+Runqueue *task_rq_lock(Task *ts);
+void rq_add(Runqueue *rq, Task *ts, int wakeup);
+void rq_remove(Runqueue *rq, Task *ts);
+void sched_start(void);
+void sched_yield(void);
+void switch_to(struct Context **old, struct Context *new);
+void task_start(void);
+void sched_tick(void);
+void sched_sleep(uint32_t ticks);
+uint32_t sched_idle_ticks(void);
+void sched_idle(void);
+void sched_wake(Task *ts);
+void sched_wakeup(Task *ts);
+int sys_migrate(int pid, int cpu);
+int sys_sched_setaffinity(int pid, uint32_t mask);
+int sys_sched_getaffinity(int pid);
+int sys_nanosleep(uint32_t sec, uint32_t nsec);
+int sys_setpriority(int pid, int nice);
+int sys_sched_setdeadline(uint32_t runtime, uint32_t period, uint32_t deadline);
+void sched_dl_exit(Runqueue *rq, Task *ts);
+int sys_nice(int inc);
+
+int task_stack_fault(Task *ts, uint32_t va);
+int sys_set_stack_limit(uint32_t bytes);
+void task_release(Task *ts);
+
 #endif
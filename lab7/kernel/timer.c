@@ -3,19 +3,147 @@
 #include <kernel/picirq.h>
 #include <kernel/task.h>
 #include <kernel/cpu.h>
+#include <kernel/timer.h>
 #include <inc/mmu.h>
 #include <inc/x86.h>
+#include <inc/stdio.h>
 
-#define TIME_HZ 100
+#define PIT_HZ		1193182	// input clock of the PIT
+#define CALIBRATE_MS	10
 
-static unsigned long jiffies = 0;
+static uint32_t lapic_per_us;	// LAPIC timer counts per microsecond
+static uint32_t tsc_per_us;	// TSC cycles per microsecond
+static uint64_t tsc_base;	// TSC at time 0
 
-void set_timer(int hz)
+/*
+ * The LAPIC timer and the TSC run at rates we have to measure.  Time
+ * both against channel 2 of the PIT, which counts at PIT_HZ, for
+ * CALIBRATE_MS: the channel is gated by bit 0 of port 0x61, and bit 5
+ * shows when its one-shot count has run out.
+ */
+static void timer_calibrate()
 {
-  int divisor = 1193180 / hz;       /* Calculate our divisor */
-  outb(0x43, 0x36);             /* Set our command byte 0x36 */
-  outb(0x40, divisor & 0xFF);   /* Set low byte of divisor */
-  outb(0x40, divisor >> 8);     /* Set high byte of divisor */
+  uint32_t latch = PIT_HZ / 1000 * CALIBRATE_MS;
+  uint32_t lapic_count;
+  uint64_t tsc;
+
+  outb(0x61, inb(0x61) & ~0x03);  /* Gate off, speaker off */
+  outb(0x43, 0xB0);               /* Channel 2, lobyte/hibyte, mode 0 */
+  outb(0x42, latch & 0xFF);
+  outb(0x42, latch >> 8);
+
+  lapic_timer(0xFFFFFFFF);
+  tsc = read_tsc();
+  outb(0x61, inb(0x61) | 0x01);   /* Gate on: start counting */
+  while (!(inb(0x61) & 0x20))
+    ;
+  lapic_count = 0xFFFFFFFF - lapic_timer_count();
+  tsc = read_tsc() - tsc;
+
+  lapic_per_us = lapic_count / (CALIBRATE_MS * 1000);
+  tsc_per_us = tsc / (CALIBRATE_MS * 1000);
+  if (lapic_per_us == 0)
+    lapic_per_us = 1;
+  if (tsc_per_us == 0)
+    tsc_per_us = 1;
+  tsc_base = read_tsc();
+  printk("LAPIC timer %u counts/us, TSC %u cycles/us\n", lapic_per_us, tsc_per_us);
+}
+
+/* Microseconds since the timer was calibrated */
+uint64_t timer_now_us()
+{
+  if (!tsc_per_us)
+    return 0;
+  return (read_tsc() - tsc_base) / tsc_per_us;
+}
+
+/* Scheduler ticks since the timer was calibrated */
+uint32_t timer_ticks()
+{
+  return timer_now_us() / TICK_US;
+}
+
+/*
+ * Set this CPU's LAPIC timer for its next event: the next scheduler
+ * tick, or later if the scheduler can go without ticks for a while
+ * (see sched_idle_ticks), or the first pending hrtimer if that is
+ * sooner.
+ */
+void timer_reprogram()
+{
+  struct CpuInfo *c = thiscpu;
+  uint64_t now = timer_now_us(), next, count;
+
+  next = (uint64_t)(now / TICK_US + sched_idle_ticks()) * TICK_US;
+  spin_lock(&c->cpu_hrtimer_lock);
+  if (c->cpu_hrtimers && c->cpu_hrtimers->expires < next)
+    next = c->cpu_hrtimers->expires;
+  spin_unlock(&c->cpu_hrtimer_lock);
+  count = next > now ? (next - now) * lapic_per_us : 1;
+  lapic_timer(count > 0xFFFFFFFF ? 0xFFFFFFFF : count);
+}
+
+/* Arm 't' to fire at 'expires' on this CPU.  Returns 1 if it is now
+ * the first to fire, and then the caller has to timer_reprogram() */
+int hrtimer_start(struct hrtimer *t, uint64_t expires)
+{
+  struct CpuInfo *c = thiscpu;
+  struct hrtimer **p;
+  int first;
+
+  spin_lock(&c->cpu_hrtimer_lock);
+  t->expires = expires;
+  t->cpu = c->cpu_id;
+  for (p = &c->cpu_hrtimers; *p && (*p)->expires <= expires; p = &(*p)->next)
+    ;
+  t->next = *p;
+  *p = t;
+  t->pending = 1;
+  first = (t == c->cpu_hrtimers);
+  spin_unlock(&c->cpu_hrtimer_lock);
+  return first;
+}
+
+/* Disarm 't', from any CPU; returns 1 if it was still pending */
+int hrtimer_cancel(struct hrtimer *t)
+{
+  struct CpuInfo *c = &cpus[t->cpu];
+  struct hrtimer **p;
+  int pending;
+
+  spin_lock(&c->cpu_hrtimer_lock);
+  if ((pending = t->pending))
+  {
+    for (p = &c->cpu_hrtimers; *p != t; p = &(*p)->next)
+      ;
+    *p = t->next;
+    t->next = NULL;
+    t->pending = 0;
+  }
+  spin_unlock(&c->cpu_hrtimer_lock);
+  return pending;
+}
+
+/* Fire every hrtimer of this CPU that is due */
+static void hrtimer_run()
+{
+  struct CpuInfo *c = thiscpu;
+  struct hrtimer *t;
+  uint64_t now = timer_now_us();
+
+  for (;;)
+  {
+    spin_lock(&c->cpu_hrtimer_lock);
+    if (!(t = c->cpu_hrtimers) || t->expires > now)
+      break;
+    c->cpu_hrtimers = t->next;
+    t->next = NULL;
+    t->pending = 0;
+    spin_unlock(&c->cpu_hrtimer_lock);
+    t->fn(t);
+  }
+  spin_unlock(&c->cpu_hrtimer_lock);
 }
 
 /* It is timer interrupt handler */
@@ -24,16 +152,12 @@ void set_timer(int hz)
 // Modify your timer_handler to support Multi processor
 // Don't forget to acknowledge the interrupt using lapic_eoi()
 //
+// The LAPIC timer is one-shot: set it again for the next event.
+//
 void timer_handler(struct Trapframe *tf)
 {
-	extern void sched_yield();
-	int i;
-
-	jiffies++;
-
-	extern Task tasks[];
-
 	lapic_eoi();
+	hrtimer_run();
 	if (thiscpu->cpu_task != NULL)
 	{	/* TODO: Lab 5
 		* 1. Maintain the status of slept tasks
@@ -45,39 +169,24 @@ void timer_handler(struct Trapframe *tf)
 		* 4. sched_yield() if the time is up for current task
 		*
 		*/
-		int i=0;
-		for(i=0;i<thiscpu->cpu_rq.total;i++)
-		{
-			int id = thiscpu->cpu_rq.runq[i];
-			if(tasks[id].state == TASK_SLEEP)
-			{
-			    tasks[id].remind_ticks--;
-			    if(tasks[id].remind_ticks==0)
-			    {
-			        tasks[id].state = TASK_RUNNABLE;
-			        tasks[id].remind_ticks = TIME_QUANT;
-				}
-			}
-	    }
-		thiscpu->cpu_task->remind_ticks--;
-		if(thiscpu->cpu_task->remind_ticks<=0)
-			sched_yield();
+		sched_tick();
 	}
+	timer_reprogram();
 }
 
 unsigned long sys_get_ticks()
 {
-  return jiffies;
+  return timer_ticks();
 }
 void timer_init()
 {
-  set_timer(TIME_HZ);
-
-  /* Enable interrupt */
-  irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_TIMER));
+  /* The PIT only calibrates the LAPIC timer, its own IRQ stays masked;
+   * every CPU takes its ticks from its LAPIC timer */
+  timer_calibrate();
 
   /* Register trap handler */
   extern void TIM_ISR();
   register_handler( IRQ_OFFSET + IRQ_TIMER, &timer_handler, &TIM_ISR, 0, 0);
+  timer_reprogram();
 }
 
@@ -1,5 +1,29 @@
 #ifndef TIMER_H
 #define TIMER_H
+
+#include <inc/types.h>
+
+#define TIME_HZ 100			// scheduler ticks per second
+#define TICK_US (1000000 / TIME_HZ)	// microseconds per tick
+
+// High-resolution timers.  Each CPU keeps its pending hrtimers sorted
+// by expiry, and its LAPIC timer, in one-shot mode, is set for the
+// first of them or the next scheduler tick, whichever comes sooner
+// (see timer_reprogram).  fn runs in the timer interrupt of the CPU
+// that started the timer, without cpu_hrtimer_lock held.
+struct hrtimer {
+	uint64_t expires;		// timer_now_us() to fire at
+	void (*fn)(struct hrtimer *);
+	struct hrtimer *next;		// on cpu_hrtimers
+	int cpu;			// whose cpu_hrtimers we are on
+	int pending;
+};
+
 void timer_init();
 unsigned long sys_get_ticks();
+uint64_t timer_now_us(void);
+uint32_t timer_ticks(void);
+void timer_reprogram(void);
+int hrtimer_start(struct hrtimer *t, uint64_t expires);
+int hrtimer_cancel(struct hrtimer *t);
 #endif
@@ -6,6 +6,7 @@
 #include <inc/x86.h>
 #include <kernel/mem.h>
 #include <kernel/cpu.h>
+#include <kernel/xcall.h>
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -164,16 +165,18 @@ trap_dispatch(struct Trapframe *tf)
 			//THINK!!!!!!
 			__asm __volatile("cli");
 
-			// Copy trap frame (which is currently on the stack)
-			// into 'cur_task->tf', so that running the environment
-			// will restart at the trap point.
-			thiscpu->cpu_task->tf = *tf;
-			//THINK!!!!!!
-			tf = &(thiscpu->cpu_task->tf);
-				
+			// The trap frame is already where 'cur_task->tf'
+			// points, at the top of the task's kernel stack, so
+			// running the environment will restart at the trap
+			// point without copying it anywhere.
 		}
 		// Do ISR
 		trap_hnd[tf->tf_trapno](tf);
+
+		// killed while it held a mutex (see task_kill_here), which it
+		// has let go of by now
+		if ((tf->tf_cs & 3) == 3 && thiscpu->cpu_task->killed)
+			sys_kill(thiscpu->cpu_task->task_id);
 		
 		// Pop the kernel stack 
 		env_pop_tf(tf);
@@ -198,10 +201,47 @@ void default_trap_handler(struct Trapframe *tf)
 
 void page_fault_handler(struct Trapframe *tf)
 {
-    printk("Page fault @ %p\n", rcr2());
+    uint32_t va = rcr2();
+
+    // Writes to copy-on-write pages, by the task itself or by the kernel
+    // touching user memory in a syscall, just need the page copied.
+    if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR) &&
+        va < UTOP && thiscpu->cpu_task &&
+        page_cow_fault(thiscpu->cpu_task->pgdir, (void *)va) == 0)
+        return;
+
+    // The user stack is mapped lazily and grows on demand.
+    if (!(tf->tf_err & FEC_PR) && thiscpu->cpu_task &&
+        task_stack_fault(thiscpu->cpu_task, va) == 0)
+        return;
+
+    printk("Page fault @ %p\n", va);
     while (1);
 }
 
+// Another CPU changed page tables we may have cached (see tlb_shootdown)
+void tlb_shootdown_handler(struct Trapframe *tf)
+{
+	tlb_shootdown_poll();
+	lapic_eoi();
+}
+
+// Other CPUs posted calls for us (see xcall_send).  They may have
+// killed the current task or moved it to another CPU, and then it
+// can't go on here, or woken a task that should run before it.
+// New work for an idle CPU is picked up by the idle loop once we
+// return.
+void xcall_handler(struct Trapframe *tf)
+{
+	Task *cur = thiscpu->cpu_task;
+
+	lapic_eoi();
+	xcall_run();
+	if (cur->state != TASK_RUNNING || cur->cpu_id != thiscpu->cpu_id ||
+	    thiscpu->cpu_rq.need_resched)
+		sched_yield();
+}
+
 void trap_init()
 {
   /* TODO: You should initialize the interrupt descriptor table.
@@ -244,6 +284,10 @@ void trap_init()
   /* Using custom trap handler */
 	extern void PGFLT();
 	register_handler(T_PGFLT, page_fault_handler, PGFLT, 1, 0);
+	extern void TLB_ISR();
+	register_handler(T_TLBFLUSH, tlb_shootdown_handler, TLB_ISR, 0, 0);
+	extern void XCALL_ISR();
+	register_handler(T_XCALL, xcall_handler, XCALL_ISR, 0, 0);
 
 	lidt(&idt_pd);
 }
\ No newline at end of file
@@ -15,6 +15,8 @@ void trap_init(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
+void tlb_shootdown_handler(struct Trapframe *);
+void xcall_handler(struct Trapframe *);
 void backtrace(struct Trapframe *);
 void page_fault();
 #endif /* JOS_KERN_TRAP_H */
@@ -0,0 +1,182 @@
+/* Wait queues, and the sleeping locks built on them */
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <kernel/wait.h>
+#include <kernel/cpu.h>
+
+void
+wq_init(struct waitqueue *wq)
+{
+	spin_initlock(&wq->wq_lock);
+	wq->wq_head = wq->wq_tail = NULL;
+}
+
+//
+// Put the current task to sleep on 'wq' and run something else.  The
+// caller holds wq->wq_lock, which is released once the task is on the
+// queue, so a wakeup can't slip in between looking for the event and
+// going to sleep.
+//
+// Returns once wq_wake has woken us, with wq->wq_lock held again.
+// Whoever woke us may not be the only one after the event, so look
+// for it again.
+//
+void
+wq_sleep(struct waitqueue *wq)
+{
+	Task *cur = thiscpu->cpu_task;
+
+	cur->wq = wq;
+	cur->wq_next = NULL;
+	if (wq->wq_tail)
+		wq->wq_tail->wq_next = cur;
+	else
+		wq->wq_head = cur;
+	wq->wq_tail = cur;
+	cur->state = TASK_SLEEP;
+	spin_unlock(&wq->wq_lock);
+
+	sched_yield();
+	spin_lock(&wq->wq_lock);
+}
+
+// Take the first sleeper off 'wq'.  Caller holds wq->wq_lock.
+static Task *
+wq_pop(struct waitqueue *wq)
+{
+	Task *ts = wq->wq_head;
+
+	if (!ts)
+		return NULL;
+	if (!(wq->wq_head = ts->wq_next))
+		wq->wq_tail = NULL;
+	ts->wq = NULL;
+	ts->wq_next = NULL;
+	return ts;
+}
+
+//
+// Wake the first sleeper on 'wq', or all of them.  The caller must not
+// hold wq->wq_lock.  Sleepers on other CPUs are woken there (see
+// sched_wakeup).
+//
+void
+wq_wake(struct waitqueue *wq, int all)
+{
+	Task *list = NULL, *ts;
+
+	spin_lock(&wq->wq_lock);
+	if (all)
+	{
+		list = wq->wq_head;
+		for (ts = list; ts; ts = ts->wq_next)
+			ts->wq = NULL;
+		wq->wq_head = wq->wq_tail = NULL;
+	}
+	else
+		list = wq_pop(wq);
+	spin_unlock(&wq->wq_lock);
+
+	while ((ts = list))
+	{
+		list = ts->wq_next;
+		ts->wq_next = NULL;
+		sched_wakeup(ts);
+	}
+}
+
+//
+// Take the task 'ts', which is being killed, off the queue it sleeps
+// on, if any.  Caller holds the lock of ts's runqueue.
+//
+void
+wq_cancel(Task *ts)
+{
+	struct waitqueue *wq = ts->wq;
+	Task *prev = NULL, *t;
+
+	if (!wq)
+		return;
+	spin_lock(&wq->wq_lock);
+	// a wq_wake may have beaten us to it
+	if (ts->wq == wq)
+	{
+		for (t = wq->wq_head; t != ts; prev = t, t = t->wq_next)
+			assert(t);
+		if (prev)
+			prev->wq_next = ts->wq_next;
+		else
+			wq->wq_head = ts->wq_next;
+		if (wq->wq_tail == ts)
+			wq->wq_tail = prev;
+		ts->wq = NULL;
+		ts->wq_next = NULL;
+	}
+	spin_unlock(&wq->wq_lock);
+}
+
+// --------------------------------------------------------------
+// Mutexes and semaphores.  A woken task competes for the lock again
+// with any newcomer.  A task holding a mutex is only killed once it
+// lets go of it (see task_kill_here).
+// --------------------------------------------------------------
+
+void
+mutex_init(struct mutex *m)
+{
+	wq_init(&m->m_wait);
+	m->m_owner = NULL;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	Task *cur = thiscpu->cpu_task;
+
+	spin_lock(&m->m_wait.wq_lock);
+	if (m->m_owner == cur)
+		panic("mutex_lock: task %d already holds it", cur->task_id);
+	while (m->m_owner)
+		wq_sleep(&m->m_wait);
+	m->m_owner = cur;
+	cur->mutexes++;
+	spin_unlock(&m->m_wait.wq_lock);
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	spin_lock(&m->m_wait.wq_lock);
+	if (m->m_owner != thiscpu->cpu_task)
+		panic("mutex_unlock: not the owner");
+	m->m_owner = NULL;
+	thiscpu->cpu_task->mutexes--;
+	spin_unlock(&m->m_wait.wq_lock);
+	wq_wake(&m->m_wait, 0);
+}
+
+void
+sem_init(struct semaphore *s, int32_t count)
+{
+	wq_init(&s->s_wait);
+	s->s_count = count;
+}
+
+void
+sem_down(struct semaphore *s)
+{
+	spin_lock(&s->s_wait.wq_lock);
+	while (s->s_count <= 0)
+		wq_sleep(&s->s_wait);
+	s->s_count--;
+	spin_unlock(&s->s_wait.wq_lock);
+}
+
+void
+sem_up(struct semaphore *s)
+{
+	spin_lock(&s->s_wait.wq_lock);
+	s->s_count++;
+	spin_unlock(&s->s_wait.wq_lock);
+	wq_wake(&s->s_wait, 0);
+}
@@ -0,0 +1,44 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <inc/types.h>
+#include <kernel/spinlock.h>
+#include <kernel/task.h>
+
+// A wait queue holds the tasks that sleep until some event, off the
+// runqueues, in the order they came.  A task sleeps on its own kernel
+// stack, anywhere in a system call, and carries on from there once
+// woken (see wq_sleep).
+struct waitqueue {
+	struct spinlock wq_lock;	// Protects the queue, and whatever
+					// the sleepers wait for
+	Task *wq_head;			// Sleepers, linked through wq_next
+	Task *wq_tail;
+};
+
+// A sleeping lock for long critical sections: tasks that find it held
+// give up the CPU instead of spinning.
+struct mutex {
+	struct waitqueue m_wait;	// m_wait.wq_lock protects m_owner
+	Task *m_owner;			// NULL if free
+};
+
+struct semaphore {
+	struct waitqueue s_wait;	// s_wait.wq_lock protects s_count
+	int32_t s_count;
+};
+
+void	wq_init(struct waitqueue *wq);
+void	wq_sleep(struct waitqueue *wq);
+void	wq_wake(struct waitqueue *wq, int all);
+void	wq_cancel(Task *ts);
+
+void	mutex_init(struct mutex *m);
+void	mutex_lock(struct mutex *m);
+void	mutex_unlock(struct mutex *m);
+
+void	sem_init(struct semaphore *s, int32_t count);
+void	sem_down(struct semaphore *s);
+void	sem_up(struct semaphore *s);
+
+#endif
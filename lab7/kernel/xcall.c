@@ -0,0 +1,88 @@
+/* Cross-CPU calls */
+#include <inc/types.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+#include <inc/syscall.h>
+#include <kernel/cpu.h>
+#include <kernel/kmalloc.h>
+#include <kernel/timer.h>
+#include <kernel/xcall.h>
+
+//
+// Post 'xc' to CPU 'cpu' and interrupt it.  Each CPU's mailbox,
+// cpu_xcalls, is a stack that any CPU pushes onto with cmpxchg and
+// only its owner empties, all at once with xchg, so neither side takes
+// a lock or waits for the other.  'xc' belongs to the caller and must
+// not be sent again before it has run.
+//
+void
+xcall_send(int cpu, struct xcall *xc)
+{
+	struct CpuInfo *c = &cpus[cpu];
+	struct xcall *head;
+
+	xc->xc_posted = timer_now_us();
+	do {
+		head = c->cpu_xcalls;
+		xc->xc_next = head;
+	} while (cmpxchg((volatile uint32_t *) &c->cpu_xcalls,
+			 (uint32_t) head, (uint32_t) xc) != (uint32_t) head);
+	lapic_ipi_cpu(c->cpu_id, T_XCALL);
+}
+
+//
+// Run fn(a1, a2) on CPU 'cpu', with an xcall from kmalloc.
+// Returns -1 if out of memory.
+//
+int
+xcall_post(int cpu, void (*fn)(uint32_t, uint32_t), uint32_t a1, uint32_t a2)
+{
+	struct xcall *xc;
+
+	if (!(xc = kmalloc(sizeof(*xc))))
+		return -1;
+	xc->xc_fn = fn;
+	xc->xc_a1 = a1;
+	xc->xc_a2 = a2;
+	xc->xc_kmalloc = 1;
+	xcall_send(cpu, xc);
+	return 0;
+}
+
+//
+// Run the calls posted to this CPU, oldest first, and keep track of
+// how long they waited.  An xcall is done with before its function
+// runs, so the function may send it again.
+//
+void
+xcall_run(void)
+{
+	struct CpuInfo *c = thiscpu;
+	struct xcall *xc, *next, *fifo = NULL;
+	void (*fn)(uint32_t, uint32_t);
+	uint32_t a1, a2, wait;
+
+	xc = (struct xcall *) xchg((volatile uint32_t *) &c->cpu_xcalls, 0);
+	for (; xc; xc = next)
+	{
+		next = xc->xc_next;
+		xc->xc_next = fifo;
+		fifo = xc;
+	}
+
+	for (xc = fifo; xc; xc = next)
+	{
+		next = xc->xc_next;
+		fn = xc->xc_fn;
+		a1 = xc->xc_a1;
+		a2 = xc->xc_a2;
+		wait = timer_now_us() - xc->xc_posted;
+		if (xc->xc_kmalloc)
+			kfree(xc);
+
+		c->cpu_stat[CPU_STAT_XCALLS]++;
+		if (wait > c->cpu_stat[CPU_STAT_XCALL_MAX_US])
+			c->cpu_stat[CPU_STAT_XCALL_MAX_US] = wait;
+		fn(a1, a2);
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef XCALL_H
+#define XCALL_H
+
+#include <inc/types.h>
+
+// A cross-CPU call: xc_fn(xc_a1, xc_a2) run by another CPU from its
+// T_XCALL interrupt, so in between its user code or while it idles,
+// never in the middle of a system call.  Posting one doesn't wait for
+// it to run.
+struct xcall {
+	struct xcall *xc_next;		// on cpu_xcalls
+	void (*xc_fn)(uint32_t, uint32_t);
+	uint32_t xc_a1, xc_a2;
+	uint32_t xc_kmalloc;		// kfree once run (see xcall_post)
+	uint64_t xc_posted;		// timer_now_us() when posted
+};
+
+void	xcall_send(int cpu, struct xcall *xc);
+int	xcall_post(int cpu, void (*fn)(uint32_t, uint32_t), uint32_t a1, uint32_t a2);
+void	xcall_run(void);
+
+#endif
@@ -16,7 +16,7 @@ int
 getchar(void)
 {
 	int r;
-	// sys_cgetc does not block, but getchar should.
+	// getc sleeps in the kernel until there is input
 	while ((r = getc()) == 0){};
 		//sys_yield();
 	return r;
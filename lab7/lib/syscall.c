@@ -102,6 +102,42 @@ SYSCALL_NOARG(cls, int32_t)
 // int32_t get_num_free_page(void);
 SYSCALL_NOARG(get_num_free_page, int)
 
+// int32_t get_num_free_block(int order);
+SYSCALL_1ARG(get_num_free_block, int32_t, int)
+
+// int32_t get_cpu_stat(int cpu, int stat);
+SYSCALL_2ARG(get_cpu_stat, int32_t, int, int)
+
+// int32_t get_kmem_stat(int cls, int stat);
+SYSCALL_2ARG(get_kmem_stat, int32_t, int, int)
+
+// int32_t get_lock_stat(int lock, int stat, char *name);
+SYSCALL_3ARG(get_lock_stat, int32_t, int, int, char *)
+
+// int32_t setpriority(int pid, int nice);
+SYSCALL_2ARG(setpriority, int32_t, int, int)
+
+// int32_t nice(int inc);
+SYSCALL_1ARG(nice, int32_t, int)
+
+// int32_t nanosleep(uint32_t sec, uint32_t nsec);
+SYSCALL_2ARG(nanosleep, int32_t, uint32_t, uint32_t)
+
+// int32_t migrate(int pid, int cpu);
+SYSCALL_2ARG(migrate, int32_t, int, int)
+
+// int32_t sched_setdeadline(uint32_t runtime, uint32_t period, uint32_t deadline);
+SYSCALL_3ARG(sched_setdeadline, int32_t, uint32_t, uint32_t, uint32_t)
+
+// int32_t sched_setaffinity(int pid, uint32_t mask);
+SYSCALL_2ARG(sched_setaffinity, int32_t, int, uint32_t)
+
+// int32_t sched_getaffinity(int pid);
+SYSCALL_1ARG(sched_getaffinity, int32_t, int)
+
+// int32_t set_stack_limit(uint32_t bytes);
+SYSCALL_1ARG(set_stack_limit, int32_t, uint32_t)
+
 
 // unsigned long get_ticks(void);
 SYSCALL_NOARG(get_ticks, unsigned long)
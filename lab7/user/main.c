@@ -18,16 +18,3 @@ int user_entry()
   for(;;){};
 }
 
-int idle_entry()
-{
-
-	asm volatile("movl %0,%%eax\n\t" \
-    "movw %%ax,%%ds\n\t" \
-    "movw %%ax,%%es\n\t" \
-    "movw %%ax,%%fs\n\t" \
-    "movw %%ax,%%gs" \
-    :: "i" (0x20 | 0x03)
-  );
-
-  for(;;){};
-}
@@ -3,6 +3,7 @@
 #include <inc/string.h>
 #include <inc/shell.h>
 #include <inc/assert.h> 
+#include <inc/x86.h>
 
 char hist[SHELL_HIST_MAX][BUF_LEN];
 
@@ -16,6 +17,9 @@ int hist_curr;
 /*  Prototypes  */
 int mon_help(int argc, char **argv);
 int mem_stat(int argc, char **argv);
+int cpu_stat(int argc, char **argv);
+int kmem_stat(int argc, char **argv);
+int lock_stat(int argc, char **argv);
 int print_tick(int argc, char **argv);
 int chgcolor(int argc, char **argv);
 int forktest(int argc, char **argv);
@@ -30,11 +34,18 @@ int spinlocktest(int argc, char **argv);
 int ls(int argc, char **argv);
 int rm(int argc, char **argv);
 int touch(int argc, char **argv);
+int setprio(int argc, char **argv);
+int migratecmd(int argc, char **argv);
+int affinity(int argc, char **argv);
+int trap_bench(int argc, char **argv);
 
 
 struct Command commands[] = {
   { "help", "Display this list of commands", mon_help },
   { "mem_stat", "Show current usage of physical memory", mem_stat },
+  { "cpu_stat", "Show per-CPU counters", cpu_stat },
+  { "kmem_stat", "Show kmalloc usage per size class", kmem_stat },
+  { "lock_stat", "Show spinlock contention per lock", lock_stat },
   { "print_tick", "Display system tick", print_tick },
   { "chgcolor", "Change screen text color", chgcolor },
   { "forktest", "Test functionality of fork()", forktest },
@@ -46,6 +57,10 @@ struct Command commands[] = {
   { "filetest4", "Error test", filetest4},
   { "filetest5", "unlink test", filetest5},
   { "spinlocktest", "Test spinlock", spinlocktest },
+  { "setprio", "Set the nice value of a task", setprio },
+  { "migrate", "Move a task to another CPU", migratecmd },
+  { "affinity", "Show or set the CPUs a task may run on", affinity },
+  { "trap_bench", "Measure the system call round trip in cycles", trap_bench },
   { "ls", "ls", ls },
   { "rm", "rm", rm },
   { "touch", "touch", touch }
@@ -54,9 +69,66 @@ const int NCOMMANDS = (sizeof(commands)/sizeof(commands[0]));
 
 int mem_stat(int argc, char **argv)
 {
+  int order, nblocks;
+
   cprintf("%-10s MEM_STAT %10s\n", "--------", "--------");
   cprintf("Used: %18d pages\n", get_num_used_page());
   cprintf("Free: %18d pages\n", get_num_free_page());
+  for (order = 0; (nblocks = get_num_free_block(order)) >= 0; order++)
+    cprintf("Order %-2d %15d blocks\n", order, nblocks);
+  return 0;
+}
+
+int cpu_stat(int argc, char **argv)
+{
+  int cpu, loads;
+
+  cprintf("%-10s CPU_STAT %10s\n", "--------", "--------");
+  cprintf("%3s %10s %10s %10s %8s %8s %7s %7s %7s\n", "CPU", "CR3 loads",
+          "TLB sent", "TLB recv", "Stolen", "Migrated", "XCalls", "Max us",
+          "DL miss");
+  for (cpu = 0; (loads = get_cpu_stat(cpu, CPU_STAT_CR3_LOADS)) >= 0; cpu++)
+    cprintf("%3d %10d %10d %10d %8d %8d %7d %7d %7d\n", cpu, loads,
+            get_cpu_stat(cpu, CPU_STAT_SHOOTDOWNS_SENT),
+            get_cpu_stat(cpu, CPU_STAT_SHOOTDOWNS_RECV),
+            get_cpu_stat(cpu, CPU_STAT_TASKS_STOLEN),
+            get_cpu_stat(cpu, CPU_STAT_TASKS_MIGRATED),
+            get_cpu_stat(cpu, CPU_STAT_XCALLS),
+            get_cpu_stat(cpu, CPU_STAT_XCALL_MAX_US),
+            get_cpu_stat(cpu, CPU_STAT_DL_MISSES));
+  return 0;
+}
+
+int kmem_stat(int argc, char **argv)
+{
+  int cls, size;
+
+  cprintf("%-10s KMEM_STAT %9s\n", "--------", "--------");
+  cprintf("%6s %10s %10s %6s\n", "Size", "Allocs", "Frees", "Slabs");
+  for (cls = 0; (size = get_kmem_stat(cls, KMEM_STAT_SIZE)) >= 0; cls++)
+    cprintf("%6d %10d %10d %6d\n", size,
+            get_kmem_stat(cls, KMEM_STAT_ALLOCS),
+            get_kmem_stat(cls, KMEM_STAT_FREES),
+            get_kmem_stat(cls, KMEM_STAT_SLABS));
+  return 0;
+}
+
+int lock_stat(int argc, char **argv)
+{
+  char name[LOCK_NAME_LEN];
+  int lock, acquires;
+
+  cprintf("%-10s LOCK_STAT %9s\n", "--------", "--------");
+  if (get_lock_stat(0, LOCK_STAT_ACQUIRES, NULL) < 0)
+  {
+    cprintf("Build the kernel with LOCKSTAT=1 to count\n");
+    return 0;
+  }
+  cprintf("%-24s %10s %10s %10s\n", "Lock", "Acquires", "Contended", "Spin kcyc");
+  for (lock = 0; (acquires = get_lock_stat(lock, LOCK_STAT_ACQUIRES, name)) >= 0; lock++)
+    cprintf("%-24s %10d %10d %10d\n", name, acquires,
+            get_lock_stat(lock, LOCK_STAT_CONTENDED, NULL),
+            get_lock_stat(lock, LOCK_STAT_SPIN_KCYCLES, NULL));
   return 0;
 }
 
@@ -173,6 +245,73 @@ int forktest(int argc, char **argv)
   return 0;
 }
 
+int setprio(int argc, char **argv)
+{
+  if (argc < 3)
+  {
+    cprintf("Usage: setprio <pid> <nice>\n");
+    return 0;
+  }
+  if (setpriority(strtol(argv[1], 0, 10), strtol(argv[2], 0, 10)) < 0)
+    cprintf("setprio: no such task or bad nice value\n");
+  return 0;
+}
+
+int migratecmd(int argc, char **argv)
+{
+  if (argc < 3)
+  {
+    cprintf("Usage: migrate <pid> <cpu>\n");
+    return 0;
+  }
+  if (migrate(strtol(argv[1], 0, 10), strtol(argv[2], 0, 10)) < 0)
+    cprintf("migrate: no such task or CPU\n");
+  return 0;
+}
+
+int affinity(int argc, char **argv)
+{
+  int pid, mask;
+
+  if (argc < 2)
+  {
+    cprintf("Usage: affinity <pid> [mask]\n");
+    return 0;
+  }
+  pid = strtol(argv[1], 0, 10);
+  if (argc > 2 && sched_setaffinity(pid, strtol(argv[2], 0, 16)) < 0)
+    cprintf("affinity: no such task, or no CPU in the mask\n");
+  else if ((mask = sched_getaffinity(pid)) < 0)
+    cprintf("affinity: no such task\n");
+  else
+    cprintf("Pid=%d, mask=%x\n", pid, mask);
+  return 0;
+}
+
+/* getpid does next to nothing in the kernel, so it takes about what
+ * the trap in and out does.  2^TRAP_BENCH_SHIFT rounds; the fastest
+ * is the path itself, and the average has timer ticks in it too. */
+#define TRAP_BENCH_SHIFT 13
+int trap_bench(int argc, char **argv)
+{
+  uint64_t start, cycles, total = 0;
+  uint32_t min = ~0U;
+  int i;
+
+  for (i = 0; i < (1 << TRAP_BENCH_SHIFT); i++)
+  {
+    start = read_tsc();
+    getpid();
+    cycles = read_tsc() - start;
+    if (cycles < min)
+      min = cycles;
+    total += cycles;
+  }
+  cprintf("getpid round trip: min %u cycles, avg %u cycles\n",
+          min, (uint32_t) (total >> TRAP_BENCH_SHIFT));
+  return 0;
+}
+
 int spinlocktest(int argc, char **argv)
 {
   /* Below code is running on user mode */